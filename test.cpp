@@ -2,43 +2,413 @@
  * Demo of a Handler/Session/Processor design implementation.
  *
  * ```
- * $ clang++-20 -std=c++17 test.cpp && ./a.out
+ * $ clang++-20 -std=c++17 -pthread test.cpp && ./a.out
  * Usage: Press a command letter, followed by <Enter>
- *   'b' -> Begin a new session
- *   'e' -> End current session
+ *   '0'-'9' -> Select the session the next commands apply to, 0 at start
+ *   'b' -> Begin a new session, replacing the selected one
+ *   'e' -> End the selected session
  *   'l' -> Load surface
  *   'u' -> Update layers
  *   'g' -> Get preview points
  *   'c' -> Create design
+ *   'p' -> Run the load, update layers and preview pipeline (C++20 builds)
+ *   's' -> Print statistics
  *   'h' -> Print this help message
  * ```
- * Only b, e, l and h are implemented. This shoul'd be enough to evaluate the implementation.
+ * All commands are implemented. This shoul'd be enough to evaluate the implementation.
  * Edge cases can be tested by sending b, e and l commands in quick successive random order. 
  */
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <chrono>
-#include <future>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <list>
+#include <map>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
 #include <queue>
 #include <random>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#if __cpp_impl_coroutine
+#include <coroutine>
+#endif
 
+#include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <cerrno>
 
-// Logging function that prints millisecond timestamp, caller's thread ID, `this` and a log message
-#define _STAMP std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count()
-#define _TID std::this_thread::get_id()
-#define _THIS std::hex << std::uppercase << std::setfill('0') << this << std::dec
-#define LOG(message) do { std::cout << _STAMP << "[" << _TID << "][" << _THIS << "] "<< __PRETTY_FUNCTION__ << " | " << message << std::flush << std::endl; } while (0)
-#define LOG_ENTER() LOG("enter")
-#define LOG_EXIT() LOG("exit")
-#define LOG_NOT_IMPLEMENTED() LOG("NOT IMPLEMENTED")
+// Log severities, in increasing order
+enum class LogLevel : int { Trace, Debug, Info, Warning, Error, Off };
+
+// Log sites below this level are compiled out. Enter/exit tracing is kept in debug builds only.
+#ifndef LOG_COMPILED_LEVEL
+#  ifdef NDEBUG
+#    define LOG_COMPILED_LEVEL Debug
+#  else
+#    define LOG_COMPILED_LEVEL Trace
+#  endif
+#endif
+constexpr LogLevel kCompiledLogLevel = LogLevel::LOG_COMPILED_LEVEL;
+
+const char *to_string(LogLevel level)
+{
+  switch (level) {
+  case LogLevel::Trace: return "trace";
+  case LogLevel::Debug: return "debug";
+  case LogLevel::Info: return "info";
+  case LogLevel::Warning: return "warning";
+  case LogLevel::Error: return "error";
+  case LogLevel::Off: return "off";
+  }
+  return "?";
+}
+
+// Asynchronous logger
+// Each thread appends raw records (timestamp, thread, object, function and message arguments) to its own
+// lock-free single producer / single consumer ring. A background thread drains the rings, orders the records by
+// time, then formats and writes them in batches. Logging never blocks: when a ring is full the record is dropped,
+// and counted.
+class Logger
+{
+public:
+  static constexpr size_t kRingSize = 1024;
+  static constexpr size_t kMaxArgs = 8;
+  static constexpr size_t kTextSize = 160; // Copied strings of a record
+
+  static Logger &Instance()
+  {
+    static Logger logger;
+    return logger;
+  }
+
+  ~Logger()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Stopping = true;
+      m_DrainerSleeping = false;
+    }
+    m_WakeUp.notify_one();
+    m_Drainer.join();
+  }
+
+  Logger(const Logger&) = delete;
+  Logger &operator=(const Logger&) = delete;
+
+  // Runtime threshold for the log sites that were compiled in
+  static bool Enabled(LogLevel level)
+  {
+    return static_cast<int>(level) >= s_Threshold.load(std::memory_order_relaxed);
+  }
+
+  static void SetThreshold(LogLevel level)
+  {
+    s_Threshold.store(static_cast<int>(level), std::memory_order_relaxed);
+  }
+
+  static LogLevel Threshold()
+  {
+    return static_cast<LogLevel>(s_Threshold.load(std::memory_order_relaxed));
+  }
+
+  // The message is the concatenation of `args`, formatted by the background thread
+  // Numbers are recorded by value, strings and character arrays are copied into the record: the output marks the
+  // ones that didn't fit. A character array can't be told from a literal, it may be a local buffer gone by then.
+  template <typename... Args>
+  void Log(const void *self, const char *function, const Args &... args)
+  {
+    static_assert(sizeof...(Args) <= kMaxArgs, "Too many log arguments");
+    Ring &ring = LocalRing();
+    Record *record = Reserve(ring);
+    if (not record) {
+      return;
+    }
+    record->stamp = std::chrono::system_clock::now().time_since_epoch().count();
+    record->thread = std::this_thread::get_id();
+    record->self = self;
+    record->function = function;
+    record->argCount = 0;
+    record->textLength = 0;
+    record->truncated = false;
+    (record->Add(args), ...);
+    Publish(ring);
+  }
+
+  uint64_t DroppedCount() const
+  {
+    return m_DroppedCount;
+  }
+
+private:
+  struct Arg
+  {
+    enum class Type : uint8_t { Literal, Text, Signed, Unsigned, Double } type;
+    union
+    {
+      const char *literal;
+      struct
+      {
+	uint32_t offset, length; // In the text of the record
+      } text;
+      int64_t i;
+      uint64_t u;
+      double d;
+    };
+  };
+
+  struct Record
+  {
+    std::chrono::system_clock::rep stamp;
+    std::thread::id thread;
+    const void *self;
+    const char *function;
+    uint8_t argCount;
+    bool truncated;
+    uint16_t textLength;
+    Arg args[kMaxArgs];
+    char text[kTextSize];
+
+    template <typename T>
+    void Add(const T &value)
+    {
+      Arg &arg = args[argCount++];
+      if constexpr (std::is_array<T>::value) {
+	static_assert(std::is_same<std::remove_extent_t<T>, const char>::value or std::is_same<std::remove_extent_t<T>, char>::value,
+		      "Only character arrays can be logged");
+	AddText(arg, std::string_view(value, std::find(value, value + std::extent<T>::value, '\0') - value));
+      }
+      else if constexpr (std::is_same<T, bool>::value) {
+	arg.type = Arg::Type::Literal;
+	arg.literal = value ? "true" : "false";
+      }
+      else if constexpr (std::is_integral<T>::value and std::is_signed<T>::value) {
+	arg.type = Arg::Type::Signed;
+	arg.i = value;
+      }
+      else if constexpr (std::is_integral<T>::value) {
+	arg.type = Arg::Type::Unsigned;
+	arg.u = value;
+      }
+      else if constexpr (std::is_floating_point<T>::value) {
+	arg.type = Arg::Type::Double;
+	arg.d = value;
+      }
+      else {
+	AddText(arg, std::string_view(value));
+      }
+    }
+
+    void AddText(Arg &arg, std::string_view string)
+    {
+      const size_t length = std::min(string.size(), kTextSize - textLength);
+      truncated |= length < string.size();
+      arg.type = Arg::Type::Text;
+      arg.text = {textLength, static_cast<uint32_t>(length)};
+      std::memcpy(text + textLength, string.data(), length);
+      textLength += length;
+    }
+  };
+
+  struct Ring
+  {
+    std::array<Record, kRingSize> records;
+    alignas(64) std::atomic<uint64_t> head{0}; // Written by the producer thread
+    alignas(64) std::atomic<uint64_t> tail{0}; // Written by the drainer
+
+    bool Empty() const
+    {
+      return head.load(std::memory_order_acquire) == tail.load(std::memory_order_relaxed);
+    }
+  };
+
+  Logger():
+    m_Drainer([this] { Run(); })
+  {}
+
+  // Next free record of the ring, nullptr if it is full
+  Record *Reserve(Ring &ring)
+  {
+    const uint64_t head = ring.head.load(std::memory_order_relaxed);
+    if (head - ring.tail.load(std::memory_order_acquire) == kRingSize) {
+      m_DroppedCount.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    return &ring.records[head % kRingSize];
+  }
+
+  // Hand the reserved record over to the drainer
+  void Publish(Ring &ring)
+  {
+    ring.head.store(ring.head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    // Pairs with the fence of the drainer going to sleep: either it sees the record, or we see it sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_DrainerSleeping.load(std::memory_order_relaxed)) {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_DrainerSleeping = false;
+      m_WakeUp.notify_one();
+    }
+  }
+
+  Ring &LocalRing()
+  {
+    static thread_local std::shared_ptr<Ring> ring;
+    if (not ring) {
+      ring = std::make_shared<Ring>();
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Rings.push_back(ring);
+    }
+    return *ring;
+  }
+
+  // Move the pending records of every ring to `batch`, forget the rings of the threads that are gone
+  void Collect(std::vector<Record> &batch)
+  {
+    std::vector<std::shared_ptr<Ring>> rings;
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Rings.erase(std::remove_if(m_Rings.begin(), m_Rings.end(), [](const std::shared_ptr<Ring> &ring) {
+	return ring.use_count() == 1 and ring->Empty();
+      }), m_Rings.end());
+      rings = m_Rings;
+    }
+    for (const auto &ring : rings) {
+      const uint64_t head = ring->head.load(std::memory_order_acquire);
+      for (uint64_t i = ring->tail.load(std::memory_order_relaxed); i != head; ++i) {
+	batch.push_back(ring->records[i % kRingSize]);
+      }
+      ring->tail.store(head, std::memory_order_release);
+    }
+  }
+
+  bool AnyPending()
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return std::any_of(m_Rings.begin(), m_Rings.end(), [](const std::shared_ptr<Ring> &ring) { return not ring->Empty(); });
+  }
+
+  void Write(const std::vector<Record> &batch)
+  {
+    std::ostringstream out;
+    for (const Record &record : batch) {
+      const auto stamp = std::chrono::duration_cast<std::chrono::milliseconds>(
+	std::chrono::system_clock::duration(record.stamp)).count();
+      out << stamp << "[" << record.thread << "][" << std::hex << std::uppercase << std::setfill('0') << record.self << std::dec
+	  << "] " << record.function << " | ";
+      for (size_t i = 0; i < record.argCount; ++i) {
+	const Arg &arg = record.args[i];
+	switch (arg.type) {
+	case Arg::Type::Literal: out << arg.literal; break;
+	case Arg::Type::Text: out.write(record.text + arg.text.offset, arg.text.length); break;
+	case Arg::Type::Signed: out << arg.i; break;
+	case Arg::Type::Unsigned: out << arg.u; break;
+	case Arg::Type::Double: out << arg.d; break;
+	}
+      }
+      if (record.truncated) {
+	out << " [truncated]";
+      }
+      out << '\n';
+    }
+    const std::string text = out.str();
+    for (size_t written = 0; written < text.size(); ) {
+      const ssize_t n = ::write(STDOUT_FILENO, text.data() + written, text.size() - written);
+      if (n < 0 and errno == EINTR) {
+	continue;
+      }
+      if (n <= 0) {
+	break;
+      }
+      written += n;
+    }
+  }
+
+  void Run()
+  {
+    std::vector<Record> batch;
+    for (;;) {
+      bool stopping;
+      {
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	stopping = m_Stopping;
+      }
+      Collect(batch);
+      if (not batch.empty()) {
+	std::stable_sort(batch.begin(), batch.end(), [](const Record &a, const Record &b) { return a.stamp < b.stamp; });
+	Write(batch);
+	batch.clear();
+	continue;
+      }
+      if (stopping) {
+	return;
+      }
+      // Nothing to do: sleep until a producer wakes us up
+      m_DrainerSleeping.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (AnyPending()) {
+	m_DrainerSleeping = false;
+	continue;
+      }
+      std::unique_lock<std::mutex> lock(m_Mutex);
+      m_WakeUp.wait(lock, [this] { return not m_DrainerSleeping or m_Stopping; });
+    }
+  }
+
+  std::mutex m_Mutex;
+  std::condition_variable m_WakeUp;
+  std::vector<std::shared_ptr<Ring>> m_Rings;
+  std::atomic<bool> m_DrainerSleeping{false};
+  std::atomic<uint64_t> m_DroppedCount{0};
+  bool m_Stopping = false;
+  std::thread m_Drainer;
+
+  static inline std::atomic<int> s_Threshold{static_cast<int>(LogLevel::Info)};
+};
+
+// Logging functions that record millisecond timestamp, caller's thread ID, `this` and a log message
+// The message is given in pieces, e.g. LOG("Loaded ", count, " vertices"): no string is built on the calling thread
+// Disabled levels compile to nothing, the arguments are not even evaluated
+#define LOG_AT(level, ...) do {                                         \
+    if constexpr (LogLevel::level >= kCompiledLogLevel) {               \
+      if (Logger::Enabled(LogLevel::level)) {                           \
+	Logger::Instance().Log(this, __PRETTY_FUNCTION__, __VA_ARGS__); \
+      }                                                                 \
+    }                                                                   \
+  } while (0)
+#define LOG_TRACE(...) LOG_AT(Trace, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(Debug, __VA_ARGS__)
+#define LOG(...) LOG_AT(Info, __VA_ARGS__)
+#define LOG_WARNING(...) LOG_AT(Warning, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(Error, __VA_ARGS__)
+#define LOG_ENTER() LOG_TRACE("enter")
+#define LOG_EXIT() LOG_TRACE("exit")
+#define LOG_NOT_IMPLEMENTED() LOG_WARNING("NOT IMPLEMENTED")
 
 // Convenience random number generator
 int random_int(int low, int high)
@@ -48,145 +418,4323 @@ int random_int(int low, int high)
     return dist(rng);
 }
 
-// Dummy types
-struct SurfaceData {};
-struct Mesh {};
-struct LayerSettings {};
+// Memory resource that maps every block it hands out, and unmaps it when it's deallocated
+// Meant as the upstream of a pool resource: it only sees the pool chunks and the large blocks
+class MappedMemoryResource : public std::pmr::memory_resource
+{
+public:
+  size_t MappedBytes() const
+  {
+    return m_MappedBytes;
+  }
+
+private:
+  static size_t MappingLength(size_t bytes)
+  {
+    static const size_t pageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    return (bytes + pageSize - 1) / pageSize * pageSize;
+  }
+
+  void *do_allocate(size_t bytes, size_t alignment) override
+  {
+    // Mappings are page aligned, for larger alignments map more and trim the excess on both sides
+    const size_t length = MappingLength(bytes);
+    const size_t slack = alignment > MappingLength(1) ? alignment : 0;
+    void *mapping = ::mmap(nullptr, length + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    char *data = static_cast<char*>(mapping);
+    if (slack) {
+      char *aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(data) + alignment - 1) & ~(alignment - 1));
+      if (aligned != data) {
+	::munmap(data, aligned - data);
+      }
+      if (aligned + length != data + length + slack) {
+	::munmap(aligned + length, data + slack - aligned);
+      }
+      data = aligned;
+    }
+    m_MappedBytes += length;
+    return data;
+  }
+
+  void do_deallocate(void *data, size_t bytes, size_t) override
+  {
+    ::munmap(data, MappingLength(bytes));
+    m_MappedBytes -= MappingLength(bytes);
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+  {
+    return this == &other;
+  }
+
+  std::atomic<size_t> m_MappedBytes{0};
+};
+
+// Memory of a session
+// Small blocks are pooled, large ones are mapped on their own: destroying the arena releases everything in a few
+// munmap calls, and sessions don't contend with each other in the global allocator.
+class SessionArena
+{
+public:
+  // Blocks up to this size are pooled, each larger block gets its own mapping
+  static constexpr size_t kLargestPooledBlock = size_t(256) << 10;
+
+  SessionArena():
+    m_Pool(std::pmr::pool_options{0, kLargestPooledBlock}, &m_Upstream)
+  {}
+
+  SessionArena(const SessionArena&) = delete;
+  SessionArena &operator=(const SessionArena&) = delete;
+
+  std::pmr::memory_resource *Resource()
+  {
+    return &m_Pool;
+  }
+
+  size_t MappedBytes() const
+  {
+    return m_Upstream.MappedBytes();
+  }
+
+private:
+  MappedMemoryResource m_Upstream;
+  std::pmr::synchronized_pool_resource m_Pool;
+};
+
+// Memory resource of the buffers created by the calling thread, the global heap by default
+// Set for the duration of a scope with MemoryResourceScope
+std::pmr::memory_resource *&CurrentMemoryResource()
+{
+  static thread_local std::pmr::memory_resource *resource = std::pmr::new_delete_resource();
+  return resource;
+}
+
+class MemoryResourceScope
+{
+public:
+  explicit MemoryResourceScope(std::pmr::memory_resource *resource):
+    m_Previous(std::exchange(CurrentMemoryResource(), resource))
+  {}
+
+  ~MemoryResourceScope()
+  {
+    CurrentMemoryResource() = m_Previous;
+  }
+
+  MemoryResourceScope(const MemoryResourceScope&) = delete;
+  MemoryResourceScope &operator=(const MemoryResourceScope&) = delete;
+
+private:
+  std::pmr::memory_resource *m_Previous;
+};
+
+// Cooperative cancellation
+// A CancellationSource owns the cancel request of one scope (an operation, a session...) and hands out
+// CancellationToken, cheap read-only views that are passed down to the Processor kernels.
+// A source can be linked to a parent token: cancelling the parent (e.g. the session) cancels every
+// child (e.g. its operations). It can be linked to a second token as well, e.g. the pipeline the operation
+// belongs to. A source can also be given a deadline after which it reads as cancelled.
+class CancellationToken
+{
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // A default constructed token is never cancelled
+  CancellationToken() = default;
+
+  bool IsCancellationRequested() const
+  {
+    return IsCancellationRequested(m_State.get(), true);
+  }
+
+  // Whether Cancel() was called on this scope or on a scope it is linked to, deadlines aside
+  // Tells an explicit cancellation from a timeout
+  bool IsCancelled() const
+  {
+    return IsCancellationRequested(m_State.get(), false);
+  }
+
+private:
+  friend class CancellationSource;
+
+  struct State
+  {
+    std::atomic<bool> cancelled{false};
+    std::atomic<Clock::rep> deadline{Clock::time_point::max().time_since_epoch().count()};
+    std::shared_ptr<const State> parent;
+    std::shared_ptr<const State> linked;
+
+    bool IsCancellationRequested(bool deadlines) const
+    {
+      if (cancelled.load(std::memory_order_relaxed)) {
+	return true;
+      }
+      if (not deadlines) {
+	return false;
+      }
+      const Clock::rep d = deadline.load(std::memory_order_relaxed);
+      return d != Clock::time_point::max().time_since_epoch().count() and Clock::now().time_since_epoch().count() >= d;
+    }
+  };
+
+  explicit CancellationToken(std::shared_ptr<const State> state):
+    m_State(std::move(state))
+  {}
+
+  static bool IsCancellationRequested(const State *state, bool deadlines)
+  {
+    for (; state; state = state->parent.get()) {
+      if (state->IsCancellationRequested(deadlines)
+	  or (state->linked and IsCancellationRequested(state->linked.get(), deadlines))) {
+	return true;
+      }
+    }
+    return false;
+  }
+
+  std::shared_ptr<const State> m_State;
+};
+
+class CancellationSource
+{
+public:
+  CancellationSource():
+    m_State(std::make_shared<CancellationToken::State>())
+  {}
+
+  // Create a source that is also cancelled when `parent` is
+  explicit CancellationSource(const CancellationToken &parent):
+    CancellationSource()
+  {
+    m_State->parent = parent.m_State;
+  }
+
+  // Create a source that is also cancelled when either `parent` or `linked` is
+  CancellationSource(const CancellationToken &parent, const CancellationToken &linked):
+    CancellationSource(parent)
+  {
+    m_State->linked = linked.m_State;
+  }
+
+  CancellationToken Token() const
+  {
+    return CancellationToken(m_State);
+  }
+
+  // Start over as a new source linked to `parent` and `linked`, as if constructed with them
+  // The state is reused when no token of the previous scope is left, so that recycled scopes (e.g. operation
+  // slots) don't allocate
+  void Reset(const CancellationToken &parent, const CancellationToken &linked = CancellationToken())
+  {
+    if (m_State.use_count() != 1) {
+      *this = CancellationSource(parent, linked);
+      return;
+    }
+    // The last token was released, what its holder read of the state happens before the new scope
+    std::atomic_thread_fence(std::memory_order_acquire);
+    m_State->cancelled.store(false, std::memory_order_relaxed);
+    m_State->deadline.store(CancellationToken::Clock::time_point::max().time_since_epoch().count(), std::memory_order_relaxed);
+    m_State->parent = parent.m_State;
+    m_State->linked = linked.m_State;
+  }
+
+  void Cancel()
+  {
+    m_State->cancelled = true;
+  }
+
+  void CancelAt(CancellationToken::Clock::time_point deadline)
+  {
+    m_State->deadline = deadline.time_since_epoch().count();
+  }
+
+  void CancelAfter(CancellationToken::Clock::duration timeout)
+  {
+    CancelAt(CancellationToken::Clock::now() + timeout);
+  }
+
+  bool IsCancellationRequested() const
+  {
+    return Token().IsCancellationRequested();
+  }
+
+private:
+  std::shared_ptr<CancellationToken::State> m_State;
+};
+
+// Move-only callable wrapper, a std::function that never copies
+// Callables of up to `Capacity` bytes that can be moved without throwing are stored inline, without allocation;
+// larger ones fall back to the heap.
+template <typename Signature, size_t Capacity = 48>
+class UniqueFunction;
+
+template <typename R, typename... Args, size_t Capacity>
+class UniqueFunction<R(Args...), Capacity>
+{
+public:
+  UniqueFunction() = default;
+
+  UniqueFunction(std::nullptr_t)
+  {}
+
+  template <typename F, typename = std::enable_if_t<not std::is_same<std::decay_t<F>, UniqueFunction>::value
+						    and std::is_invocable_r<R, std::decay_t<F>&, Args...>::value>>
+  UniqueFunction(F &&f)
+  {
+    using Callable = std::decay_t<F>;
+    if constexpr (IsInline<Callable>()) {
+      new (&m_Storage) Callable(std::forward<F>(f));
+      m_Ops = &InlineOps<Callable>::kOps;
+    }
+    else {
+      *reinterpret_cast<Callable**>(&m_Storage) = new Callable(std::forward<F>(f));
+      m_Ops = &HeapOps<Callable>::kOps;
+    }
+  }
+
+  UniqueFunction(UniqueFunction &&other) noexcept
+  {
+    MoveFrom(other);
+  }
+
+  UniqueFunction &operator=(UniqueFunction &&other) noexcept
+  {
+    if (this != &other) {
+      Reset();
+      MoveFrom(other);
+    }
+    return *this;
+  }
+
+  UniqueFunction &operator=(std::nullptr_t)
+  {
+    Reset();
+    return *this;
+  }
+
+  ~UniqueFunction()
+  {
+    Reset();
+  }
+
+  explicit operator bool() const
+  {
+    return m_Ops != nullptr;
+  }
+
+  R operator()(Args... args)
+  {
+    return m_Ops->invoke(&m_Storage, std::forward<Args>(args)...);
+  }
+
+private:
+  struct Ops
+  {
+    R (*invoke)(void *storage, Args&&... args);
+    void (*move)(void *to, void *from); // Leaves `from` destroyed
+    void (*destroy)(void *storage);
+  };
+
+  template <typename F>
+  static constexpr bool IsInline()
+  {
+    return sizeof(F) <= Capacity and alignof(F) <= alignof(std::max_align_t) and std::is_nothrow_move_constructible<F>::value;
+  }
+
+  template <typename F>
+  struct InlineOps
+  {
+    static R Invoke(void *storage, Args&&... args)
+    {
+      return std::invoke(*static_cast<F*>(storage), std::forward<Args>(args)...);
+    }
+
+    static void Move(void *to, void *from)
+    {
+      new (to) F(std::move(*static_cast<F*>(from)));
+      static_cast<F*>(from)->~F();
+    }
+
+    static void Destroy(void *storage)
+    {
+      static_cast<F*>(storage)->~F();
+    }
+
+    static constexpr Ops kOps{Invoke, Move, Destroy};
+  };
+
+  template <typename F>
+  struct HeapOps
+  {
+    static R Invoke(void *storage, Args&&... args)
+    {
+      return std::invoke(**static_cast<F**>(storage), std::forward<Args>(args)...);
+    }
+
+    static void Move(void *to, void *from)
+    {
+      *static_cast<F**>(to) = *static_cast<F**>(from);
+    }
+
+    static void Destroy(void *storage)
+    {
+      delete *static_cast<F**>(storage);
+    }
+
+    static constexpr Ops kOps{Invoke, Move, Destroy};
+  };
+
+  void MoveFrom(UniqueFunction &other)
+  {
+    if (other.m_Ops) {
+      other.m_Ops->move(&m_Storage, &other.m_Storage);
+      m_Ops = std::exchange(other.m_Ops, nullptr);
+    }
+  }
+
+  void Reset()
+  {
+    if (m_Ops) {
+      std::exchange(m_Ops, nullptr)->destroy(&m_Storage);
+    }
+  }
+
+  const Ops *m_Ops = nullptr;
+  alignas(std::max_align_t) unsigned char m_Storage[Capacity];
+};
+
+// Process-wide fixed-size pool of worker threads, shared by all sessions and processors.
+// Each worker owns a job deque: it pops its own jobs LIFO and, when idle, steals from the
+// other workers FIFO. The number of queued jobs is bounded, Enqueue() rejects jobs beyond it.
+// Interactive jobs are taken before background ones. Background jobs yield at their ParallelFor chunk
+// boundaries: the worker runs the queued interactive jobs, then resumes the background work.
+class WorkerPool
+{
+public:
+  using Job = UniqueFunction<void()>;
+
+  enum class Priority : uint8_t
+  {
+    Interactive,
+    Background,
+  };
+
+  static constexpr size_t kDefaultQueueCapacity = 256;
+
+  static WorkerPool &Instance()
+  {
+    static WorkerPool pool(std::max(2u, std::thread::hardware_concurrency()), kDefaultQueueCapacity);
+    return pool;
+  }
+
+  WorkerPool(size_t workerCount, size_t queueCapacity):
+    m_QueueCapacity(queueCapacity)
+  {
+    // Constructed first, so that the logger outlives the workers
+    Logger::Instance();
+    for (size_t i = 0; i < workerCount; ++i) {
+      m_Workers.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < workerCount; ++i) {
+      m_Workers[i]->thread = std::thread([this, i] { Run(i); });
+    }
+  }
+
+  ~WorkerPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_SleepMutex);
+      m_Stopping = true;
+    }
+    m_WakeUp.notify_all();
+    for (auto &worker : m_Workers) {
+      worker->thread.join();
+    }
+  }
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool &operator=(const WorkerPool&) = delete;
+
+  // Enqueue a job, returns false if the queue is full
+  // If `token` is cancelled before the job starts, `dropped` runs instead of the job
+  bool Enqueue(Job job, CancellationToken token = CancellationToken(), Job dropped = nullptr,
+	       Priority priority = Priority::Interactive)
+  {
+    if (not Reserve()) {
+      ++m_RejectedCount;
+      return false;
+    }
+    Push({std::move(job), std::move(token), std::move(dropped), priority});
+    return true;
+  }
+
+  // Yield point of long kernels: when called from a background job, run the queued interactive jobs
+  // on the calling worker before returning. Cheap when there is nothing to run.
+  // Returns the number of jobs run
+  size_t Yield()
+  {
+    const int self = CurrentWorkerIndex();
+    if (self < 0 or CurrentPriority() == Priority::Interactive or m_InteractiveDepth == 0) {
+      return 0;
+    }
+    size_t count = 0;
+    Entry job;
+    while (TryPop(self, Priority::Interactive, job)) {
+      --m_QueueDepth;
+      RunEntry(job);
+      ++count;
+    }
+    m_YieldedCount += count;
+    return count;
+  }
+
+  // Take the queued jobs whose token is cancelled out of the queue, and run their `dropped` hook on the
+  // calling thread. Cancelled work doesn't have to wait for a worker to free up.
+  // Returns the number of jobs dropped
+  size_t DropCancelled()
+  {
+    std::vector<Entry> dropped;
+    for (auto &worker : m_Workers) {
+      std::lock_guard<std::mutex> lock(worker->mutex);
+      for (auto &jobs : worker->jobs) {
+	auto cancelled = std::stable_partition(jobs.begin(), jobs.end(), [](const Entry &entry) {
+	  return not entry.IsDropped();
+	});
+	if (&jobs == &worker->jobs[static_cast<size_t>(Priority::Interactive)]) {
+	  m_InteractiveDepth -= jobs.end() - cancelled;
+	}
+	std::move(cancelled, jobs.end(), std::back_inserter(dropped));
+	jobs.erase(cancelled, jobs.end());
+      }
+    }
+    m_QueueDepth -= dropped.size();
+    m_DroppedCount += dropped.size();
+    for (Entry &entry : dropped) {
+      entry.Run();
+    }
+    return dropped.size();
+  }
+
+  // Run fn(chunkBegin, chunkEnd) over [begin, end) split in chunks of `grain` elements.
+  // The caller takes part in the work, so this never deadlocks even when called from a worker
+  // or when the queue is full. Returns once every chunk has been processed.
+  // If a chunk throws, the chunks not started yet are skipped and the first exception is rethrown on the caller
+  // Helpers get the priority of the calling job, background loops yield between chunks.
+  // `fn` is called through a plain function pointer, only the small loop state is allocated: late helpers
+  // may still hold it after the call returns.
+  template <typename Fn>
+  void ParallelFor(size_t begin, size_t end, size_t grain, const Fn &fn)
+  {
+    if (begin >= end) {
+      return;
+    }
+    grain = std::max<size_t>(grain, 1);
+    struct Loop
+    {
+      size_t begin, end, grain, chunkCount;
+      const void *fn;
+      void (*invoke)(const void *fn, size_t chunkBegin, size_t chunkEnd);
+      std::pmr::memory_resource *resource; // Of the caller, helpers allocate from it too
+      WorkerPool *pool;
+      std::atomic<size_t> nextChunk{0};
+      std::atomic<size_t> doneChunks{0};
+      std::atomic<bool> failed{false};
+      std::exception_ptr error; // Of the first chunk that threw, under the mutex
+      std::mutex mutex;
+      std::condition_variable finished; // Of the last chunk
+
+      // Claim and process chunks until there is none left
+      // Yields before claiming a chunk, so that no chunk waits on the interactive jobs
+      void Drain()
+      {
+	for (;;) {
+	  pool->Yield();
+	  const size_t chunk = nextChunk++;
+	  if (chunk >= chunkCount) {
+	    break;
+	  }
+	  if (not failed.load(std::memory_order_relaxed)) {
+	    MemoryResourceScope scope(resource);
+	    const size_t first = begin + chunk * grain;
+	    try {
+	      invoke(fn, first, std::min(end, first + grain));
+	    }
+	    catch (...) {
+	      std::lock_guard<std::mutex> lock(mutex);
+	      if (not error) {
+		error = std::current_exception();
+	      }
+	      failed.store(true, std::memory_order_relaxed);
+	    }
+	  }
+	  // Failed and skipped chunks count as done, or the caller would wait for them forever
+	  if (++doneChunks == chunkCount) {
+	    // Under the lock, so that the caller can't miss it between its check and its wait
+	    std::lock_guard<std::mutex> lock(mutex);
+	    finished.notify_one();
+	  }
+	}
+      }
+    };
+    auto loop = std::make_shared<Loop>();
+    loop->begin = begin;
+    loop->end = end;
+    loop->grain = grain;
+    loop->chunkCount = (end - begin + grain - 1) / grain;
+    loop->fn = &fn;
+    loop->invoke = [](const void *fn, size_t chunkBegin, size_t chunkEnd) {
+      (*static_cast<const Fn*>(fn))(chunkBegin, chunkEnd);
+    };
+    loop->resource = CurrentMemoryResource();
+    loop->pool = this;
+    // Helpers that start after all chunks were claimed exit right away without touching `fn`
+    const size_t helpers = std::min(loop->chunkCount, m_Workers.size()) - 1;
+    for (size_t i = 0; i < helpers and Reserve(); ++i) {
+      Push({[loop] { loop->Drain(); }, CancellationToken(), nullptr, CurrentPriority()});
+    }
+    loop->Drain();
+    // Every chunk is claimed, the last ones are still being processed by helpers: sleep until they are done
+    std::unique_lock<std::mutex> lock(loop->mutex);
+    loop->finished.wait(lock, [&] { return loop->doneChunks == loop->chunkCount; });
+    if (loop->error) {
+      std::rethrow_exception(loop->error);
+    }
+  }
+
+  size_t WorkerCount() const
+  {
+    return m_Workers.size();
+  }
+
+  size_t QueueCapacity() const
+  {
+    return m_QueueCapacity;
+  }
+
+  size_t QueueDepth() const
+  {
+    return m_QueueDepth;
+  }
+
+  uint64_t RejectedCount() const
+  {
+    return m_RejectedCount;
+  }
+
+  uint64_t StolenCount() const
+  {
+    return m_StolenCount;
+  }
+
+  // Jobs dropped from the queue because they were cancelled before they started
+  uint64_t DroppedCount() const
+  {
+    return m_DroppedCount;
+  }
+
+  // Interactive jobs run by workers that yielded from a background job
+  uint64_t YieldedCount() const
+  {
+    return m_YieldedCount;
+  }
+
+private:
+  // Queued job, with the cancellation and hook of Enqueue()
+  struct Entry
+  {
+    Job job;
+    CancellationToken token;
+    Job dropped;
+    Priority priority;
+
+    bool IsDropped() const
+    {
+      return dropped and token.IsCancellationRequested();
+    }
+
+    void Run()
+    {
+      if (IsDropped()) {
+	dropped();
+      }
+      else {
+	job();
+      }
+    }
+  };
+
+  struct Worker
+  {
+    std::mutex mutex;
+    std::array<std::deque<Entry>, 2> jobs; // Indexed by Priority
+    std::thread thread;
+  };
+
+  // Index of the calling worker in m_Workers, -1 for non-worker threads
+  static int &CurrentWorkerIndex()
+  {
+    static thread_local int index = -1;
+    return index;
+  }
+
+  // Priority of the job the calling thread runs
+  static Priority &CurrentPriority()
+  {
+    static thread_local Priority priority = Priority::Interactive;
+    return priority;
+  }
+
+  // Run a job with its priority, from the worker loop or nested in a yielding job
+  // The job starts from the heap resource, whatever the job it may be nested in was using
+  static void RunEntry(Entry &job)
+  {
+    MemoryResourceScope scope(std::pmr::new_delete_resource());
+    const Priority previous = std::exchange(CurrentPriority(), job.priority);
+    job.Run();
+    CurrentPriority() = previous;
+  }
+
+  // Take one slot in the bounded queue
+  bool Reserve()
+  {
+    size_t depth = m_QueueDepth;
+    do {
+      if (depth >= m_QueueCapacity) {
+	return false;
+      }
+    } while (not m_QueueDepth.compare_exchange_weak(depth, depth + 1));
+    return true;
+  }
+
+  // Enqueue a job on the calling worker deque, or round robin when called from outside the pool
+  void Push(Entry job)
+  {
+    const int self = CurrentWorkerIndex();
+    const size_t target = self >= 0 ? self : m_NextWorker++ % m_Workers.size();
+    const size_t level = static_cast<size_t>(job.priority);
+    {
+      std::lock_guard<std::mutex> lock(m_Workers[target]->mutex);
+      m_Workers[target]->jobs[level].push_back(std::move(job));
+      if (level == static_cast<size_t>(Priority::Interactive)) {
+	++m_InteractiveDepth;
+      }
+    }
+    {
+      // Empty critical section, so that a worker about to sleep can't miss the notification
+      std::lock_guard<std::mutex> lock(m_SleepMutex);
+    }
+    m_WakeUp.notify_one();
+  }
+
+  // Take a job of priority `lowest` or higher, higher priorities first
+  bool TryPop(size_t index, Priority lowest, Entry &job)
+  {
+    for (size_t level = 0; level <= static_cast<size_t>(lowest); ++level) {
+      if (TryPopLevel(index, level, job)) {
+	if (level == static_cast<size_t>(Priority::Interactive)) {
+	  --m_InteractiveDepth;
+	}
+	return true;
+      }
+    }
+    return false;
+  }
+
+  bool TryPopLevel(size_t index, size_t level, Entry &job)
+  {
+    // Own jobs first (LIFO, cache warm), then steal from the others (FIFO, oldest first)
+    {
+      Worker &self = *m_Workers[index];
+      std::lock_guard<std::mutex> lock(self.mutex);
+      if (not self.jobs[level].empty()) {
+	job = std::move(self.jobs[level].back());
+	self.jobs[level].pop_back();
+	return true;
+      }
+    }
+    for (size_t i = 1; i < m_Workers.size(); ++i) {
+      Worker &victim = *m_Workers[(index + i) % m_Workers.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (not victim.jobs[level].empty()) {
+	job = std::move(victim.jobs[level].front());
+	victim.jobs[level].pop_front();
+	++m_StolenCount;
+	return true;
+      }
+    }
+    return false;
+  }
+
+  void Run(size_t index)
+  {
+    CurrentWorkerIndex() = static_cast<int>(index);
+    for (;;) {
+      Entry job;
+      if (TryPop(index, Priority::Background, job)) {
+	--m_QueueDepth;
+	RunEntry(job);
+	continue;
+      }
+      std::unique_lock<std::mutex> lock(m_SleepMutex);
+      if (m_Stopping and m_QueueDepth == 0) {
+	return;
+      }
+      // Push() goes through m_SleepMutex before notifying, the wakeup can't be missed
+      m_WakeUp.wait(lock, [this] { return m_Stopping or m_QueueDepth > 0; });
+    }
+  }
+
+  const size_t m_QueueCapacity;
+  std::vector<std::unique_ptr<Worker>> m_Workers;
+  std::atomic<size_t> m_NextWorker{0};
+  std::atomic<size_t> m_QueueDepth{0};
+  std::atomic<uint64_t> m_RejectedCount{0};
+  std::atomic<uint64_t> m_StolenCount{0};
+  std::atomic<uint64_t> m_DroppedCount{0};
+  std::atomic<uint64_t> m_YieldedCount{0};
+  std::atomic<size_t> m_InteractiveDepth{0}; // Queued interactive jobs, checked by Yield()
+  std::mutex m_SleepMutex;
+  std::condition_variable m_WakeUp;
+  bool m_Stopping = false;
+};
+
+// Sort [begin, end) on the worker pool: slices are sorted in parallel, then merged pairwise
+// The token is checked before each slice and each merge, the range is left partly sorted when cancelled
+// Returns 0 on success, -ECANCELED if cancelled
+template <typename T, typename Less>
+int parallel_sort(T *begin, T *end, Less less, const CancellationToken &token)
+{
+  const size_t count = end - begin;
+  WorkerPool &pool = WorkerPool::Instance();
+  if (count < (1 << 16) or pool.WorkerCount() < 2) {
+    if (token.IsCancellationRequested()) {
+      return -ECANCELED;
+    }
+    std::sort(begin, end, less);
+    return 0;
+  }
+  size_t sliceCount = 1;
+  while (sliceCount < 2 * pool.WorkerCount() and count / sliceCount > (1 << 15)) {
+    sliceCount *= 2;
+  }
+  auto bound = [&](size_t slice) {
+    return begin + count * slice / sliceCount;
+  };
+  pool.ParallelFor(0, sliceCount, 1, [&](size_t first, size_t last) {
+    for (size_t slice = first; slice < last and not token.IsCancellationRequested(); ++slice) {
+      std::sort(bound(slice), bound(slice + 1), less);
+    }
+  });
+  for (size_t width = 1; width < sliceCount; width *= 2) {
+    if (token.IsCancellationRequested()) {
+      return -ECANCELED;
+    }
+    pool.ParallelFor(0, sliceCount / (2 * width), 1, [&](size_t first, size_t last) {
+      for (size_t pair = first; pair < last and not token.IsCancellationRequested(); ++pair) {
+	const size_t slice = pair * 2 * width;
+	std::inplace_merge(bound(slice), bound(slice + width), bound(slice + 2 * width), less);
+      }
+    });
+  }
+  return token.IsCancellationRequested() ? -ECANCELED : 0;
+}
+
+// Wakes up the main loop when an operation finishes
+// Wraps an eventfd that is registered in the main loop poll set, Notify() can be called from any thread.
+class CompletionNotifier
+{
+public:
+  CompletionNotifier():
+    m_Fd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+  {
+    if (m_Fd < 0) {
+      std::perror("eventfd");
+    }
+  }
+
+  ~CompletionNotifier()
+  {
+    if (m_Fd >= 0) {
+      ::close(m_Fd);
+    }
+  }
+
+  CompletionNotifier(const CompletionNotifier&) = delete;
+  CompletionNotifier &operator=(const CompletionNotifier&) = delete;
+
+  int Fd() const
+  {
+    return m_Fd;
+  }
+
+  void Notify()
+  {
+    const uint64_t one = 1;
+    // Can only fail if the counter would overflow, in which case the fd is readable anyway
+    (void)!::write(m_Fd, &one, sizeof(one));
+  }
+
+  // Reset the fd to non-readable, returns the number of notifications since the last call
+  uint64_t Drain()
+  {
+    uint64_t count = 0;
+    if (::read(m_Fd, &count, sizeof(count)) != sizeof(count)) {
+      return 0;
+    }
+    return count;
+  }
+
+private:
+  int m_Fd;
+};
+
+// Hands work results over to the main loop
+// Workers Post() completions to a lock-free multiple producer/single consumer list, and the main loop runs them
+// from Dispatch() in posting order, once woken up by the eventfd. Handler-side state is thus only ever touched by
+// the main thread.
+// Completions are intrusive nodes embedded in whatever they report on, posting one allocates nothing.
+class CompletionQueue
+{
+public:
+  // A node is posted at most once until it is dispatched, and its owner keeps it alive until then
+  struct Node
+  {
+    void (*run)(Node &node) = nullptr;
+    Node *next = nullptr;
+  };
+
+  CompletionQueue() = default;
+
+  // Pending completions are dropped, whatever they refer to may already be gone
+  ~CompletionQueue() = default;
+
+  CompletionQueue(const CompletionQueue&) = delete;
+  CompletionQueue &operator=(const CompletionQueue&) = delete;
+
+  int Fd() const
+  {
+    return m_Notifier.Fd();
+  }
+
+  // Can be called from any thread
+  void Post(Node &node)
+  {
+    node.next = m_Head.load(std::memory_order_relaxed);
+    while (not m_Head.compare_exchange_weak(node.next, &node, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    // The consumer takes the whole list at once, only the first completion of a batch needs to wake it up
+    if (not node.next) {
+      m_Notifier.Notify();
+    }
+  }
+
+  // Wake up the main loop without posting anything, can be called from any thread
+  void Notify()
+  {
+    m_Notifier.Notify();
+  }
+
+  // Run the posted completions on the calling thread, returns how many were run
+  size_t Dispatch()
+  {
+    m_Notifier.Drain();
+    // The list is a stack, reverse it to run the completions in posting order
+    Node *node = m_Head.exchange(nullptr, std::memory_order_acquire);
+    Node *ordered = nullptr;
+    while (node) {
+      Node *next = node->next;
+      node->next = ordered;
+      ordered = node;
+      node = next;
+    }
+    size_t count = 0;
+    while (ordered) {
+      // The node may be posted again as soon as it runs
+      Node *current = std::exchange(ordered, ordered->next);
+      current->run(*current);
+      ++count;
+    }
+    return count;
+  }
+
+private:
+  CompletionNotifier m_Notifier;
+  std::atomic<Node*> m_Head{nullptr};
+};
+
+// Destroys objects on a low priority background thread
+// Freeing large meshes can take a while, the main loop hands them over here instead of stalling on it
+// `onReclaimed` is called from the reclaimer thread after each object is destroyed, e.g. to wake up whoever waits
+// for the memory to be given back
+class Reclaimer
+{
+public:
+  explicit Reclaimer(UniqueFunction<void()> onReclaimed = nullptr):
+    m_OnReclaimed(std::move(onReclaimed)),
+    m_Thread([this] { Run(); })
+  {}
+
+  // Destroys whatever is still pending
+  ~Reclaimer()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Stopping = true;
+    }
+    m_WakeUp.notify_one();
+    m_Thread.join();
+  }
+
+  Reclaimer(const Reclaimer&) = delete;
+  Reclaimer &operator=(const Reclaimer&) = delete;
+
+  // `bytes` is the memory held by the object, counted in PendingBytes() until it is destroyed
+  template <typename T>
+  void Retire(std::unique_ptr<T> object, size_t bytes = 0)
+  {
+    if (not object) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Pending.push_back({[object = std::move(object)]() mutable { object.reset(); }, bytes});
+      m_PendingBytes += bytes;
+    }
+    m_WakeUp.notify_one();
+  }
+
+  // Objects retired but not destroyed yet
+  size_t PendingCount() const
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Pending.size();
+  }
+
+  size_t PendingBytes() const
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_PendingBytes;
+  }
+
+  uint64_t ReclaimedCount() const
+  {
+    return m_ReclaimedCount;
+  }
+
+private:
+  void Run()
+  {
+    // Only run when nothing else wants the CPU
+    sched_param param{};
+    if (::pthread_setschedparam(::pthread_self(), SCHED_IDLE, &param) != 0) {
+      LOG_WARNING("SCHED_IDLE not available");
+    }
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    for (;;) {
+      m_WakeUp.wait(lock, [this] { return m_Stopping or not m_Pending.empty(); });
+      if (m_Pending.empty()) {
+	return;
+      }
+      // Destroy the oldest one outside of the lock, it stays counted as pending until then
+      {
+	UniqueFunction<void()> destroy = std::move(m_Pending.front().destroy);
+	lock.unlock();
+	destroy();
+      }
+      lock.lock();
+      m_PendingBytes -= m_Pending.front().bytes;
+      m_Pending.pop_front();
+      ++m_ReclaimedCount;
+      if (m_OnReclaimed) {
+	lock.unlock();
+	m_OnReclaimed();
+	lock.lock();
+      }
+    }
+  }
+
+  struct Retired
+  {
+    UniqueFunction<void()> destroy;
+    size_t bytes;
+  };
+
+  mutable std::mutex m_Mutex;
+  std::condition_variable m_WakeUp;
+  std::deque<Retired> m_Pending;
+  size_t m_PendingBytes = 0; // Guarded by m_Mutex
+  std::atomic<uint64_t> m_ReclaimedCount{0};
+  bool m_Stopping = false;
+  UniqueFunction<void()> m_OnReclaimed;
+  std::thread m_Thread;
+};
+
+// Growable array of trivially copyable elements in a single 64-byte aligned block
+// Keeps the hot arrays of the mesh kernels cache-line aligned, and SIMD friendly
+// Memory comes from the resource given at construction, or else from the current memory resource of the thread
+// that first allocates it. Moves carry it along.
+template <typename T>
+class AlignedBuffer
+{
+  static_assert(std::is_trivially_copyable<T>::value, "AlignedBuffer only holds trivially copyable types");
+
+public:
+  static constexpr size_t kAlignment = 64;
+
+  AlignedBuffer() = default;
+
+  explicit AlignedBuffer(std::pmr::memory_resource *resource):
+    m_Resource(resource)
+  {}
+
+  AlignedBuffer(const AlignedBuffer &other)
+  {
+    *this = other;
+  }
+
+  AlignedBuffer(AlignedBuffer &&other) noexcept:
+    m_Resource(other.m_Resource),
+    m_Data(std::exchange(other.m_Data, nullptr)),
+    m_Size(std::exchange(other.m_Size, 0)),
+    m_Capacity(std::exchange(other.m_Capacity, 0))
+  {}
+
+  AlignedBuffer &operator=(const AlignedBuffer &other)
+  {
+    if (this != &other) {
+      m_Size = 0;
+      reserve(other.m_Size);
+      if (other.m_Size) {
+	std::memcpy(m_Data, other.m_Data, other.m_Size * sizeof(T));
+      }
+      m_Size = other.m_Size;
+    }
+    return *this;
+  }
+
+  AlignedBuffer &operator=(AlignedBuffer &&other) noexcept
+  {
+    if (this != &other) {
+      Free();
+      m_Resource = other.m_Resource;
+      m_Data = std::exchange(other.m_Data, nullptr);
+      m_Size = std::exchange(other.m_Size, 0);
+      m_Capacity = std::exchange(other.m_Capacity, 0);
+    }
+    return *this;
+  }
+
+  ~AlignedBuffer()
+  {
+    Free();
+  }
+
+  T *data() { return m_Data; }
+  const T *data() const { return m_Data; }
+  T *begin() { return m_Data; }
+  T *end() { return m_Data + m_Size; }
+  const T *begin() const { return m_Data; }
+  const T *end() const { return m_Data + m_Size; }
+  T &operator[](size_t i) { return m_Data[i]; }
+  const T &operator[](size_t i) const { return m_Data[i]; }
+  size_t size() const { return m_Size; }
+  size_t capacity() const { return m_Capacity; }
+  bool empty() const { return m_Size == 0; }
+
+  void clear()
+  {
+    m_Size = 0;
+  }
+
+  void reserve(size_t capacity)
+  {
+    if (capacity <= m_Capacity) {
+      return;
+    }
+    if (not m_Resource) {
+      m_Resource = CurrentMemoryResource();
+    }
+    T *data = static_cast<T*>(m_Resource->allocate(capacity * sizeof(T), kAlignment));
+    if (m_Size) {
+      std::memcpy(data, m_Data, m_Size * sizeof(T));
+    }
+    Free();
+    m_Data = data;
+    m_Capacity = capacity;
+  }
+
+  // New elements are left uninitialized
+  void resize(size_t size)
+  {
+    if (size > m_Capacity) {
+      reserve(std::max(size, m_Capacity * 2));
+    }
+    m_Size = size;
+  }
+
+  void push_back(const T &value)
+  {
+    if (m_Size == m_Capacity) {
+      reserve(std::max<size_t>(16, m_Capacity * 2));
+    }
+    m_Data[m_Size++] = value;
+  }
+
+  void append(const T *values, size_t count)
+  {
+    if (count == 0) {
+      return;
+    }
+    const size_t offset = m_Size;
+    resize(m_Size + count);
+    std::memcpy(m_Data + offset, values, count * sizeof(T));
+  }
+
+private:
+  void Free()
+  {
+    if (m_Data) {
+      m_Resource->deallocate(m_Data, m_Capacity * sizeof(T), kAlignment);
+    }
+  }
+
+  std::pmr::memory_resource *m_Resource = nullptr;
+  T *m_Data = nullptr;
+  size_t m_Size = 0;
+  size_t m_Capacity = 0;
+};
+
+// Read-only view of a triangulated surface, this is what the kernels work on
+// Vertices are stored as structure of arrays, triangles as 3 consecutive vertex indices
+struct MeshView
+{
+  const double *x = nullptr;
+  const double *y = nullptr;
+  const double *z = nullptr;
+  const uint32_t *indices = nullptr;
+  uint32_t vertexCount = 0;
+  uint32_t triangleCount = 0;
+};
+
+// Triangulated mesh
+// Vertices are stored as structure of arrays (x[], y[], z[]) and triangles as a flat buffer of 32-bit
+// vertex indices, so that the kernels stream through contiguous, aligned arrays.
+// Coordinates are doubles, survey coordinates don't fit the float precision.
+// Half-edge adjacency is optional and built on first use: half-edge 3*t+k of triangle t goes from
+// vertex k to vertex (k+1)%3 of t, its twin is the opposite half-edge in the neighbouring triangle.
+class Mesh
+{
+public:
+  static constexpr uint32_t kInvalidIndex = UINT32_MAX;
+
+  uint32_t VertexCount() const
+  {
+    return static_cast<uint32_t>(m_X.size());
+  }
+
+  uint32_t TriangleCount() const
+  {
+    return static_cast<uint32_t>(m_Indices.size() / 3);
+  }
+
+  bool Empty() const
+  {
+    return m_Indices.empty();
+  }
+
+  void Reserve(size_t vertexCount, size_t triangleCount)
+  {
+    m_X.reserve(vertexCount);
+    m_Y.reserve(vertexCount);
+    m_Z.reserve(vertexCount);
+    m_Indices.reserve(3 * triangleCount);
+  }
+
+  uint32_t AddVertex(double x, double y, double z)
+  {
+    m_X.push_back(x);
+    m_Y.push_back(y);
+    m_Z.push_back(z);
+    ClearAdjacency();
+    return VertexCount() - 1;
+  }
+
+  void AddTriangle(uint32_t a, uint32_t b, uint32_t c)
+  {
+    m_Indices.push_back(a);
+    m_Indices.push_back(b);
+    m_Indices.push_back(c);
+    ClearAdjacency();
+  }
+
+  void AppendVertices(const double *x, const double *y, const double *z, size_t count)
+  {
+    m_X.append(x, count);
+    m_Y.append(y, count);
+    m_Z.append(z, count);
+    ClearAdjacency();
+  }
+
+  // `indices` holds 3 vertex indices per triangle
+  void AppendTriangles(const uint32_t *indices, size_t triangleCount)
+  {
+    m_Indices.append(indices, 3 * triangleCount);
+    ClearAdjacency();
+  }
+
+  void Clear()
+  {
+    m_X.clear();
+    m_Y.clear();
+    m_Z.clear();
+    m_Indices.clear();
+    ClearAdjacency();
+  }
+
+  const double *X() const { return m_X.data(); }
+  const double *Y() const { return m_Y.data(); }
+  const double *Z() const { return m_Z.data(); }
+  const uint32_t *Indices() const { return m_Indices.data(); }
+
+  MeshView View() const
+  {
+    return {m_X.data(), m_Y.data(), m_Z.data(), m_Indices.data(), VertexCount(), TriangleCount()};
+  }
+
+  bool HasAdjacency() const
+  {
+    return m_Twins.size() == m_Indices.size() and m_VertexHalfEdges.size() == m_X.size() and not m_Indices.empty();
+  }
+
+  // Twin of each half-edge, kInvalidIndex on the boundary
+  // Built on first call, not thread-safe: build it before sharing the mesh between threads
+  const AlignedBuffer<uint32_t> &Twins()
+  {
+    if (not HasAdjacency()) {
+      BuildAdjacency();
+    }
+    return m_Twins;
+  }
+
+  // One outgoing half-edge per vertex, kInvalidIndex for isolated vertices
+  const AlignedBuffer<uint32_t> &VertexHalfEdges()
+  {
+    if (not HasAdjacency()) {
+      BuildAdjacency();
+    }
+    return m_VertexHalfEdges;
+  }
+
+  static uint32_t NextHalfEdge(uint32_t h)
+  {
+    return h % 3 == 2 ? h - 2 : h + 1;
+  }
+
+  static uint32_t PrevHalfEdge(uint32_t h)
+  {
+    return h % 3 == 0 ? h + 2 : h - 1;
+  }
+
+  uint32_t HalfEdgeOrigin(uint32_t h) const
+  {
+    return m_Indices[h];
+  }
+
+  size_t MemoryFootprint() const
+  {
+    return (m_X.capacity() + m_Y.capacity() + m_Z.capacity()) * sizeof(double)
+      + (m_Indices.capacity() + m_Twins.capacity() + m_VertexHalfEdges.capacity()) * sizeof(uint32_t);
+  }
+
+private:
+  // Every mutation makes the adjacency stale: new vertices have no outgoing half-edge yet
+  void ClearAdjacency()
+  {
+    m_Twins.clear();
+    m_VertexHalfEdges.clear();
+  }
+
+  // Match half-edges by sorting their (origin, destination) keys, no hash table or per-edge allocation
+  void BuildAdjacency()
+  {
+    const uint32_t halfEdgeCount = static_cast<uint32_t>(m_Indices.size());
+    auto edgeKey = [](uint32_t from, uint32_t to) {
+      return (static_cast<uint64_t>(from) << 32) | to;
+    };
+    struct KeyedHalfEdge
+    {
+      uint64_t key;
+      uint32_t halfEdge;
+    };
+    AlignedBuffer<KeyedHalfEdge> keys;
+    keys.resize(halfEdgeCount);
+    for (uint32_t h = 0; h < halfEdgeCount; ++h) {
+      keys[h] = {edgeKey(m_Indices[h], m_Indices[NextHalfEdge(h)]), h};
+    }
+    std::sort(keys.begin(), keys.end(), [](const KeyedHalfEdge &a, const KeyedHalfEdge &b) { return a.key < b.key; });
+
+    m_Twins.resize(halfEdgeCount);
+    m_VertexHalfEdges.resize(VertexCount());
+    std::fill(m_VertexHalfEdges.begin(), m_VertexHalfEdges.end(), kInvalidIndex);
+    for (uint32_t h = 0; h < halfEdgeCount; ++h) {
+      const uint32_t from = m_Indices[h];
+      const uint32_t to = m_Indices[NextHalfEdge(h)];
+      const uint64_t twinKey = edgeKey(to, from);
+      auto it = std::lower_bound(keys.begin(), keys.end(), twinKey,
+				 [](const KeyedHalfEdge &a, uint64_t key) { return a.key < key; });
+      m_Twins[h] = (it != keys.end() and it->key == twinKey) ? it->halfEdge : kInvalidIndex;
+      // Prefer boundary half-edges so that one-ring traversals can start from the boundary
+      if (m_VertexHalfEdges[from] == kInvalidIndex or m_Twins[h] == kInvalidIndex) {
+	m_VertexHalfEdges[from] = h;
+      }
+    }
+  }
+
+  AlignedBuffer<double> m_X;
+  AlignedBuffer<double> m_Y;
+  AlignedBuffer<double> m_Z;
+  AlignedBuffer<uint32_t> m_Indices;
+  AlignedBuffer<uint32_t> m_Twins;
+  AlignedBuffer<uint32_t> m_VertexHalfEdges;
+};
+
+// Read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+  MappedFile() = default;
+
+  MappedFile(MappedFile &&other) noexcept:
+    m_Data(std::exchange(other.m_Data, nullptr)),
+    m_Size(std::exchange(other.m_Size, 0))
+  {}
+
+  MappedFile &operator=(MappedFile &&other) noexcept
+  {
+    if (this != &other) {
+      Close();
+      m_Data = std::exchange(other.m_Data, nullptr);
+      m_Size = std::exchange(other.m_Size, 0);
+    }
+    return *this;
+  }
+
+  ~MappedFile()
+  {
+    Close();
+  }
+
+  // Returns 0 on success, -errno on failure
+  int Open(const std::string &path)
+  {
+    Close();
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return -errno;
+    }
+    struct stat st{};
+    if (::fstat(fd, &st) != 0) {
+      const int rc = -errno;
+      ::close(fd);
+      return rc;
+    }
+    if (st.st_size == 0) {
+      ::close(fd);
+      return -EINVAL;
+    }
+    void *data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    const int rc = data == MAP_FAILED ? -errno : 0;
+    // The mapping keeps its own reference on the file
+    ::close(fd);
+    if (rc != 0) {
+      return rc;
+    }
+    m_Data = static_cast<const uint8_t*>(data);
+    m_Size = static_cast<size_t>(st.st_size);
+    return 0;
+  }
+
+  void Close()
+  {
+    if (m_Data) {
+      ::munmap(const_cast<uint8_t*>(m_Data), m_Size);
+      m_Data = nullptr;
+      m_Size = 0;
+    }
+  }
+
+  const uint8_t *Data() const
+  {
+    return m_Data;
+  }
+
+  size_t Size() const
+  {
+    return m_Size;
+  }
+
+private:
+  const uint8_t *m_Data = nullptr;
+  size_t m_Size = 0;
+};
+
+// Header of the binary TIN container (.tin)
+// The file is laid out so that it can be used in place once mapped: the vertex coordinates are stored as
+// structure of arrays (x[], y[], z[] as doubles) followed by the triangle indices (3 x uint32 per
+// triangle). Each array starts at a 64-byte aligned offset. All values are in host (little endian) order.
+struct TinFileHeader
+{
+  static constexpr char kMagic[8] = {'L', 'L', 'T', 'I', 'N', '\0', '\0', '\0'};
+  static constexpr uint32_t kVersion = 1;
+  static constexpr uint32_t kByteOrderMark = 0x01020304;
+
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrderMark;
+  uint64_t vertexCount;
+  uint64_t triangleCount;
+  uint64_t xOffset;
+  uint64_t yOffset;
+  uint64_t zOffset;
+  uint64_t indicesOffset;
+};
+
+// A loaded surface
+// Either views the arrays of a memory mapped .tin file in place, or owns the mesh it was built from.
+class SurfaceData
+{
+public:
+  SurfaceData() = default;
+
+  explicit SurfaceData(Mesh mesh):
+    m_Mesh(std::move(mesh)),
+    m_View(m_Mesh.View())
+  {}
+
+  // Map a .tin file, nothing is parsed or copied: the view points into the mapping
+  // Returns 0 on success, -errno on failure
+  int MapTinFile(const std::string &path, const CancellationToken &token)
+  {
+    MappedFile file;
+    int rc = file.Open(path);
+    if (rc != 0) {
+      return rc;
+    }
+    TinFileHeader header;
+    if (file.Size() < sizeof(header)) {
+      return -EINVAL;
+    }
+    std::memcpy(&header, file.Data(), sizeof(header));
+    if (std::memcmp(header.magic, TinFileHeader::kMagic, sizeof(header.magic)) != 0
+	or header.version != TinFileHeader::kVersion
+	or header.byteOrderMark != TinFileHeader::kByteOrderMark
+	or header.vertexCount > Mesh::kInvalidIndex
+	or header.triangleCount > Mesh::kInvalidIndex / 3) {
+      return -EINVAL;
+    }
+    auto arrayFits = [&file](uint64_t offset, uint64_t bytes) {
+      return offset % AlignedBuffer<double>::kAlignment == 0 and offset <= file.Size() and bytes <= file.Size() - offset;
+    };
+    const uint64_t coordinateBytes = header.vertexCount * sizeof(double);
+    if (not arrayFits(header.xOffset, coordinateBytes)
+	or not arrayFits(header.yOffset, coordinateBytes)
+	or not arrayFits(header.zOffset, coordinateBytes)
+	or not arrayFits(header.indicesOffset, header.triangleCount * 3 * sizeof(uint32_t))) {
+      return -EINVAL;
+    }
+    MeshView view;
+    view.x = reinterpret_cast<const double*>(file.Data() + header.xOffset);
+    view.y = reinterpret_cast<const double*>(file.Data() + header.yOffset);
+    view.z = reinterpret_cast<const double*>(file.Data() + header.zOffset);
+    view.indices = reinterpret_cast<const uint32_t*>(file.Data() + header.indicesOffset);
+    view.vertexCount = static_cast<uint32_t>(header.vertexCount);
+    view.triangleCount = static_cast<uint32_t>(header.triangleCount);
+    // Out of range indices would make the kernels read past the arrays, this is the only pass over the data
+    rc = ValidateIndices(view, token);
+    if (rc != 0) {
+      return rc;
+    }
+    m_Mesh.Clear();
+    m_Mapping = std::move(file);
+    m_View = view;
+    return 0;
+  }
+
+  bool Empty() const
+  {
+    return m_View.vertexCount == 0;
+  }
+
+  MeshView View() const
+  {
+    return m_View;
+  }
+
+  bool IsMapped() const
+  {
+    return m_Mapping.Data() != nullptr;
+  }
+
+  // Heap memory owned by the surface, mapped files are backed by the page cache and not accounted
+  size_t MemoryFootprint() const
+  {
+    return m_Mesh.MemoryFootprint();
+  }
+
+private:
+  static int ValidateIndices(const MeshView &view, const CancellationToken &token)
+  {
+    std::atomic<bool> valid{true};
+    WorkerPool::Instance().ParallelFor(0, size_t(view.triangleCount) * 3, 1 << 20, [&](size_t begin, size_t end) {
+      if (token.IsCancellationRequested()) {
+	return;
+      }
+      uint32_t maxIndex = 0;
+      for (size_t i = begin; i < end; ++i) {
+	maxIndex = std::max(maxIndex, view.indices[i]);
+      }
+      if (maxIndex >= view.vertexCount) {
+	valid = false;
+      }
+    });
+    if (token.IsCancellationRequested()) {
+      return -ECANCELED;
+    }
+    return valid ? 0 : -EINVAL;
+  }
+
+  MappedFile m_Mapping;
+  Mesh m_Mesh;
+  MeshView m_View;
+};
+
+// Number parsing for the text importers
+// Fast path for the usual survey numbers (up to 19 significant digits, small exponent) which are exactly
+// representable and thus correctly rounded, digits are consumed 8 at a time with SWAR arithmetic.
+// Anything else falls back to strtod.
+inline bool is_eight_digits(uint64_t chars)
+{
+  return (((chars & 0xF0F0F0F0F0F0F0F0) | (((chars + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) == 0x3333333333333333);
+}
+
+// Value of 8 ASCII digits loaded as a little endian word
+inline uint32_t parse_eight_digits(uint64_t chars)
+{
+  chars -= 0x3030303030303030;
+  chars = (chars * 10) + (chars >> 8);
+  chars = (((chars & 0x000000FF000000FF) * 0x000F424000000064) + (((chars >> 16) & 0x000000FF000000FF) * 0x0000271000000001)) >> 32;
+  return static_cast<uint32_t>(chars);
+}
+
+// Accumulate the digits at `p` into `mantissa`, returns the number of digits consumed
+// Digits that don't fit in 19 significant digits are consumed but not accumulated, and counted in `dropped`
+inline size_t parse_digits(const char *&p, const char *end, uint64_t &mantissa, int &significant, int &dropped)
+{
+  const char *start = p;
+  while (end - p >= 8 and significant + 8 <= 19) {
+    uint64_t chars;
+    std::memcpy(&chars, p, sizeof(chars));
+    if (not is_eight_digits(chars)) {
+      break;
+    }
+    mantissa = mantissa * 100000000 + parse_eight_digits(chars);
+    significant += mantissa ? 8 : 0;
+    p += 8;
+  }
+  for (; p != end and *p >= '0' and *p <= '9'; ++p) {
+    if (significant < 19) {
+      mantissa = mantissa * 10 + (*p - '0');
+      significant += mantissa ? 1 : 0;
+    }
+    else {
+      ++dropped;
+    }
+  }
+  return p - start;
+}
+
+inline bool parse_double(const char *&p, const char *end, double &value)
+{
+  static constexpr double kPowersOfTen[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  const char *start = p;
+  const bool negative = p != end and *p == '-';
+  if (p != end and (*p == '-' or *p == '+')) {
+    ++p;
+  }
+  uint64_t mantissa = 0;
+  int significant = 0;
+  int dropped = 0;
+  size_t digits = parse_digits(p, end, mantissa, significant, dropped);
+  int exponent = dropped;
+  if (p != end and *p == '.') {
+    ++p;
+    const int integerDropped = dropped;
+    const size_t fraction = parse_digits(p, end, mantissa, significant, dropped);
+    exponent -= static_cast<int>(fraction) - (dropped - integerDropped);
+    digits += fraction;
+  }
+  if (digits == 0) {
+    p = start;
+    return false;
+  }
+  if (p != end and (*p == 'e' or *p == 'E')) {
+    const char *e = p + 1;
+    const bool negativeExponent = e != end and *e == '-';
+    if (e != end and (*e == '-' or *e == '+')) {
+      ++e;
+    }
+    int value = 0;
+    const char *digitsStart = e;
+    for (; e != end and *e >= '0' and *e <= '9'; ++e) {
+      value = std::min(value * 10 + (*e - '0'), 100000);
+    }
+    if (e != digitsStart) {
+      exponent += negativeExponent ? -value : value;
+      p = e;
+    }
+  }
+  if (dropped == 0 and mantissa <= (uint64_t(1) << 53) and exponent >= -22 and exponent <= 22) {
+    value = static_cast<double>(mantissa);
+    value = exponent < 0 ? value / kPowersOfTen[-exponent] : value * kPowersOfTen[exponent];
+    value = negative ? -value : value;
+    return true;
+  }
+  // strtod needs a terminated copy, of the whole token: overlong ones (e.g. padded with zeros) go to the heap
+  const size_t length = p - start;
+  char buffer[128];
+  if (length < sizeof(buffer)) {
+    std::memcpy(buffer, start, length);
+    buffer[length] = '\0';
+    value = std::strtod(buffer, nullptr);
+  }
+  else {
+    value = std::strtod(std::string(start, length).c_str(), nullptr);
+  }
+  return true;
+}
+
+inline bool parse_uint(const char *&p, const char *end, uint64_t &value)
+{
+  const char *start = p;
+  value = 0;
+  for (; p != end and *p >= '0' and *p <= '9'; ++p) {
+    value = value * 10 + (*p - '0');
+  }
+  return p != start;
+}
+
+inline const char *skip_blanks(const char *p, const char *end)
+{
+  while (p != end and (*p == ' ' or *p == '\t' or *p == '\r' or *p == '\n')) {
+    ++p;
+  }
+  return p;
+}
+
+// Streaming, parallel importer for the text surface formats: LandXML TIN surfaces and XYZ point files
+// The file is read block by block. Each block is cut after its last complete record, split in chunks at
+// record boundaries and the chunks are parsed in parallel, then appended in order to the mesh. Only one
+// block of text is held in memory at any time.
+class SurfaceImporter
+{
+  // Point id and vertex index, for the lookup of the points of the faces
+  struct PointIndex
+  {
+    uint64_t id;
+    uint32_t index;
+  };
+
+  // Parsed records of one chunk
+  struct Chunk
+  {
+    explicit Chunk(std::pmr::memory_resource *resource):
+      x(resource), y(resource), z(resource), pointIds(resource), faceIds(resource)
+    {}
+
+    AlignedBuffer<double> x, y, z;
+    AlignedBuffer<uint64_t> pointIds;
+    AlignedBuffer<uint64_t> faceIds; // 3 point ids per face
+
+    void Clear()
+    {
+      x.clear();
+      y.clear();
+      z.clear();
+      pointIds.clear();
+      faceIds.clear();
+    }
+  };
+
+public:
+  // Working buffers of an import, keep them across imports so that they don't have to be allocated again
+  struct Scratch
+  {
+    explicit Scratch(std::pmr::memory_resource *resource = CurrentMemoryResource()):
+      resource(resource),
+      buffer(resource),
+      result(resource),
+      pointIndexes(resource),
+      indices(resource)
+    {}
+
+    std::pmr::memory_resource *resource;
+    AlignedBuffer<char> buffer; // Text of the current block
+    std::vector<Chunk> chunks;
+    std::vector<std::pair<const char*, const char*>> ranges;
+    Chunk result;
+    AlignedBuffer<PointIndex> pointIndexes; // Sorted by id, when the points are not numbered in order
+    AlignedBuffer<uint32_t> indices;        // Resolved faces
+  };
+
+  // LandXML <Pnts>/<Faces> definition of a TIN surface
+  // Points are "northing easting elevation", faces reference point ids. Invisible faces (i="1") are skipped.
+  // Returns 0 on success, -errno on failure
+  static int ImportLandXml(const std::string &path, const CancellationToken &token, Mesh &mesh, Scratch &scratch)
+  {
+    int rc = ParseFile(path, token, mesh, scratch, LastXmlBoundary, NextXmlBoundary, ParseXmlChunk);
+    if (rc != 0) {
+      return rc;
+    }
+    return ResolveFaces(scratch, mesh);
+  }
+
+  // Text file with one "x y z" point per line, separated by blanks, commas or semicolons
+  // Extra columns and lines that don't start with a number (headers, comments) are ignored.
+  // Point files have no triangles.
+  static int ImportXyz(const std::string &path, const CancellationToken &token, Mesh &mesh, Scratch &scratch)
+  {
+    return ParseFile(path, token, mesh, scratch, LastLineBoundary, NextLineBoundary, ParseXyzChunk);
+  }
+
+private:
+  static constexpr size_t kBlockSize = 16 << 20;
+  static constexpr size_t kChunkSize = 1 << 20;
+  static constexpr uint64_t kNoId = UINT64_MAX;
+
+  // Returns the end of the text that can be parsed now, the rest is carried over to the next block
+  using LastBoundaryFn = const char *(*)(const char *begin, const char *end);
+  // Returns the first record boundary at or after `from`
+  using NextBoundaryFn = const char *(*)(const char *from, const char *end);
+  using ParseFn = void (*)(const char *begin, const char *end, Chunk &chunk);
+
+  static int ParseFile(const std::string &path, const CancellationToken &token, Mesh &mesh, Scratch &scratch,
+		       LastBoundaryFn lastBoundary, NextBoundaryFn nextBoundary, ParseFn parse)
+  {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return -errno;
+    }
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    AlignedBuffer<char> &buffer = scratch.buffer;
+    buffer.resize(std::max(buffer.size(), kBlockSize));
+    std::vector<Chunk> &chunks = scratch.chunks;
+    std::vector<std::pair<const char*, const char*>> &ranges = scratch.ranges;
+    Chunk &result = scratch.result;
+    result.Clear();
+    size_t carry = 0;
+    bool eof = false;
+    int rc = 0;
+    while (not eof) {
+      if (token.IsCancellationRequested()) {
+	rc = -ECANCELED;
+	break;
+      }
+      if (carry == buffer.size()) {
+	// A single record larger than a block
+	buffer.resize(2 * buffer.size());
+      }
+      const ssize_t n = ::read(fd, buffer.data() + carry, buffer.size() - carry);
+      if (n < 0) {
+	if (errno == EINTR) {
+	  continue;
+	}
+	rc = -errno;
+	break;
+      }
+      eof = n == 0;
+      const char *begin = buffer.data();
+      const char *end = begin + carry + n;
+      const char *cut = eof ? end : lastBoundary(begin, end);
+
+      ranges.clear();
+      for (const char *p = begin; p < cut; ) {
+	const char *next = p + kChunkSize < cut ? std::min(nextBoundary(p + kChunkSize, cut), cut) : cut;
+	ranges.emplace_back(p, next);
+	p = next;
+      }
+      while (chunks.size() < ranges.size()) {
+	chunks.emplace_back(scratch.resource);
+      }
+      WorkerPool::Instance().ParallelFor(0, ranges.size(), 1, [&](size_t first, size_t last) {
+	for (size_t i = first; i < last; ++i) {
+	  chunks[i].Clear();
+	  parse(ranges[i].first, ranges[i].second, chunks[i]);
+	}
+      });
+      for (size_t i = 0; i < ranges.size(); ++i) {
+	const Chunk &chunk = chunks[i];
+	mesh.AppendVertices(chunk.x.data(), chunk.y.data(), chunk.z.data(), chunk.x.size());
+	result.pointIds.append(chunk.pointIds.data(), chunk.pointIds.size());
+	result.faceIds.append(chunk.faceIds.data(), chunk.faceIds.size());
+      }
+      if (result.pointIds.size() > Mesh::kInvalidIndex or mesh.VertexCount() >= Mesh::kInvalidIndex) {
+	rc = -EFBIG;
+	break;
+      }
+      carry = end - cut;
+      std::memmove(buffer.data(), cut, carry);
+    }
+    ::close(fd);
+    return rc;
+  }
+
+  // Map the point ids of the faces to vertex indices
+  static int ResolveFaces(Scratch &scratch, Mesh &mesh)
+  {
+    const Chunk &result = scratch.result;
+    const AlignedBuffer<uint64_t> &ids = result.pointIds;
+    // Usual case: points are numbered 1..N in order
+    bool sequential = true;
+    for (size_t i = 0; i < ids.size() and sequential; ++i) {
+      sequential = ids[i] == i + 1;
+    }
+    AlignedBuffer<PointIndex> &sortedIds = scratch.pointIndexes;
+    sortedIds.clear();
+    if (not sequential) {
+      sortedIds.resize(ids.size());
+      for (size_t i = 0; i < ids.size(); ++i) {
+	sortedIds[i] = {ids[i], static_cast<uint32_t>(i)};
+      }
+      std::sort(sortedIds.begin(), sortedIds.end(), [](const PointIndex &a, const PointIndex &b) {
+	return a.id < b.id;
+      });
+    }
+    auto indexOf = [&](uint64_t id) -> uint32_t {
+      if (sequential) {
+	return id >= 1 and id <= ids.size() ? static_cast<uint32_t>(id - 1) : Mesh::kInvalidIndex;
+      }
+      const PointIndex *it = std::lower_bound(sortedIds.begin(), sortedIds.end(), id, [](const PointIndex &a, uint64_t value) {
+	return a.id < value;
+      });
+      return it != sortedIds.end() and it->id == id ? it->index : Mesh::kInvalidIndex;
+    };
+    AlignedBuffer<uint32_t> &indices = scratch.indices;
+    indices.clear();
+    indices.reserve(result.faceIds.size());
+    for (size_t i = 0; i + 2 < result.faceIds.size(); i += 3) {
+      const uint32_t a = indexOf(result.faceIds[i]);
+      const uint32_t b = indexOf(result.faceIds[i + 1]);
+      const uint32_t c = indexOf(result.faceIds[i + 2]);
+      if (a == Mesh::kInvalidIndex or b == Mesh::kInvalidIndex or c == Mesh::kInvalidIndex) {
+	return -EINVAL;
+      }
+      indices.push_back(a);
+      indices.push_back(b);
+      indices.push_back(c);
+    }
+    mesh.AppendTriangles(indices.data(), indices.size() / 3);
+    return 0;
+  }
+
+  static const char *LastLineBoundary(const char *begin, const char *end)
+  {
+    const void *newline = ::memrchr(begin, '\n', end - begin);
+    return newline ? static_cast<const char*>(newline) + 1 : begin;
+  }
+
+  static const char *NextLineBoundary(const char *from, const char *end)
+  {
+    const void *newline = std::memchr(from, '\n', end - from);
+    return newline ? static_cast<const char*>(newline) + 1 : end;
+  }
+
+  static void ParseXyzChunk(const char *begin, const char *end, Chunk &chunk)
+  {
+    for (const char *line = begin; line < end; line = NextLineBoundary(line, end)) {
+      const char *p = line;
+      double values[3];
+      int count = 0;
+      for (; count < 3; ++count) {
+	while (p != end and (*p == ' ' or *p == '\t' or *p == ',' or *p == ';')) {
+	  ++p;
+	}
+	if (not parse_double(p, end, values[count])) {
+	  break;
+	}
+      }
+      if (count == 3) {
+	chunk.x.push_back(values[0]);
+	chunk.y.push_back(values[1]);
+	chunk.z.push_back(values[2]);
+      }
+    }
+  }
+
+  // <P ...> or <F ...> start tag, but not <Pnts>, <Faces>...
+  static bool IsRecordTag(const char *lt, const char *end)
+  {
+    return end - lt >= 3 and (lt[1] == 'P' or lt[1] == 'F') and (lt[2] == ' ' or lt[2] == '>' or lt[2] == '\t');
+  }
+
+  // </P> or </F> end tag
+  static bool IsRecordEndTag(const char *lt, const char *end)
+  {
+    return end - lt >= 4 and lt[1] == '/' and (lt[2] == 'P' or lt[2] == 'F') and lt[3] == '>';
+  }
+
+  static const char *LastXmlBoundary(const char *begin, const char *end)
+  {
+    const char *lastRecordStart = nullptr;
+    for (const char *p = end; p > begin; ) {
+      const void *lt = ::memrchr(begin, '<', p - begin);
+      if (not lt) {
+	break;
+      }
+      p = static_cast<const char*>(lt);
+      if (IsRecordEndTag(p, end)) {
+	return p + 4;
+      }
+      if (IsRecordTag(p, end)) {
+	lastRecordStart = p;
+      }
+    }
+    // No complete record: the text before the record start (headers...) can be dropped
+    if (lastRecordStart) {
+      return lastRecordStart;
+    }
+    const void *lt = ::memrchr(begin, '<', end - begin);
+    return lt ? static_cast<const char*>(lt) : end;
+  }
+
+  static const char *NextXmlBoundary(const char *from, const char *end)
+  {
+    for (const char *p = from; p < end; ++p) {
+      p = static_cast<const char*>(std::memchr(p, '<', end - p));
+      if (not p) {
+	break;
+      }
+      if (IsRecordEndTag(p, end)) {
+	return p + 4;
+      }
+    }
+    return end;
+  }
+
+  // Value of the `name="..."` attribute of a start tag, if it is a number
+  static bool ParseIdAttribute(const char *tag, const char *tagEnd, const char *name, uint64_t &value)
+  {
+    const size_t nameLength = std::strlen(name);
+    for (const char *p = tag; p + nameLength + 2 < tagEnd; ++p) {
+      if ((p[-1] == ' ' or p[-1] == '\t') and std::memcmp(p, name, nameLength) == 0
+	  and p[nameLength] == '=' and p[nameLength + 1] == '"') {
+	p += nameLength + 2;
+	return parse_uint(p, tagEnd, value) and p != tagEnd and *p == '"';
+      }
+    }
+    return false;
+  }
+
+  static void ParseXmlChunk(const char *begin, const char *end, Chunk &chunk)
+  {
+    for (const char *p = begin; p < end; ) {
+      p = static_cast<const char*>(std::memchr(p, '<', end - p));
+      if (not p) {
+	break;
+      }
+      if (not IsRecordTag(p, end)) {
+	++p;
+	continue;
+      }
+      const bool isPoint = p[1] == 'P';
+      const char *tagEnd = static_cast<const char*>(std::memchr(p, '>', end - p));
+      if (not tagEnd) {
+	break;
+      }
+      const char *text = tagEnd + 1;
+      if (isPoint) {
+	uint64_t id;
+	double values[3];
+	int count = 0;
+	for (; count < 3 and parse_double(text = skip_blanks(text, end), end, values[count]); ++count) {
+	}
+	if (count == 3) {
+	  chunk.pointIds.push_back(ParseIdAttribute(p + 2, tagEnd, "id", id) ? id : kNoId);
+	  chunk.x.push_back(values[1]);
+	  chunk.y.push_back(values[0]);
+	  chunk.z.push_back(values[2]);
+	}
+      }
+      else {
+	uint64_t invisible = 0;
+	uint64_t ids[3];
+	int count = 0;
+	for (; count < 3 and parse_uint(text = skip_blanks(text, end), end, ids[count]); ++count) {
+	}
+	if (count == 3 and not (ParseIdAttribute(p + 2, tagEnd, "i", invisible) and invisible == 1)) {
+	  chunk.faceIds.append(ids, 3);
+	}
+      }
+      p = text;
+    }
+  }
+};
+
+enum class SurfaceKind
+{
+  Critical,
+  Cut,
+  Fill
+};
+
+const char *to_string(SurfaceKind kind)
+{
+  switch (kind) {
+  case SurfaceKind::Critical:
+    return "Critical";
+  case SurfaceKind::Cut:
+    return "Cut";
+  case SurfaceKind::Fill:
+    return "Fill";
+  }
+  return "?";
+}
+
+struct Box2
+{
+  double minX = -std::numeric_limits<double>::infinity();
+  double minY = -std::numeric_limits<double>::infinity();
+  double maxX = std::numeric_limits<double>::infinity();
+  double maxY = std::numeric_limits<double>::infinity();
+
+  bool Contains(double x, double y) const
+  {
+    return x >= minX and x <= maxX and y >= minY and y <= maxY;
+  }
+};
+
+// Lift layers are the slabs [baseElevation + k * liftThickness, baseElevation + (k + 1) * liftThickness), k may be
+// negative: the base elevation sets where the planes are, not where slicing starts
+struct LayerSettings
+{
+  double baseElevation = 0.0;
+  double liftThickness = 0.3;
+  uint32_t maxLayerCount = 1024;
+};
+
+// The part of a surface that lies within one lift
+struct Layer
+{
+  double bottom = 0.0;
+  double top = 0.0;
+  Mesh mesh;
+};
+
+// Layers are immutable once computed, and shared between the slicer cache and the session layer lists
+// Lists, layers and their meshes are allocated from the memory resource of the session
+using LayerList = std::pmr::vector<std::shared_ptr<const Layer>>;
+
+// Slices a surface into lift layers
+// The triangles are sorted by their lowest elevation once per surface. A lift [bottom, top) is then
+// covered by a contiguous range of that order: triangles with zmin in [bottom - maxHeight, top), where
+// maxHeight is the tallest triangle extent. Layer ranges are spread across the worker pool and each
+// triangle is only clipped against the lifts it spans, instead of testing every triangle for every plane.
+// Layer meshes are indexed: the clipped triangles share the surface vertices and the plane crossings of the
+// surface edges, as the surface triangles did.
+// Computed layers are cached by lift bounds until the surface changes: when the settings change, only the
+// lifts whose planes moved are sliced again.
+class LayerSlicer
+{
+public:
+  // The cached layers are allocated from `resource`
+  explicit LayerSlicer(std::pmr::memory_resource *resource = CurrentMemoryResource()):
+    m_Cache(resource)
+  {}
+
+  // Upper bound of the memory kept by the cache, on top of the layers still referenced by the session
+  static constexpr size_t kCacheBudget = size_t(256) << 20;
+
+  struct SortKey
+  {
+    double zmin;
+    uint32_t triangle;
+  };
+
+  // Point of a clipped triangle, with where it comes from: a vertex of the surface, or the crossing of a
+  // surface edge with a plane of the lift
+  struct Point
+  {
+    double x, y, z;
+    uint32_t a, b;  // Surface vertex when a == b, else the surface edge (a, b), a < b
+    uint32_t plane; // kVertex, kBottom or kTop
+  };
+
+  // Corner of an output triangle of a layer, at `position` in its index list
+  struct Corner
+  {
+    Point point;
+    uint32_t position;
+  };
+
+  // Working buffers of one run of layers
+  struct PieceScratch
+  {
+    std::vector<AlignedBuffer<Corner>> corners; // Per layer of the run
+    AlignedBuffer<uint32_t> indices{std::pmr::new_delete_resource()};
+  };
+
+  // Working buffers of Slice(), they can be kept across calls
+  // The layers are left empty between calls: their meshes belong to the session, and are handed over to the cache
+  struct Scratch
+  {
+    std::vector<Layer> layers;
+    std::vector<std::pair<size_t, size_t>> pieces; // Runs of layers to slice
+    mutable std::mutex pieceMutex;
+    std::vector<std::unique_ptr<PieceScratch>> idlePieces; // One per run sliced at the same time
+
+    void Clear()
+    {
+      layers.clear();
+      pieces.clear();
+      std::lock_guard<std::mutex> lock(pieceMutex);
+      for (auto &piece : idlePieces) {
+	for (auto &corners : piece->corners) {
+	  corners.clear();
+	}
+	piece->indices.clear();
+      }
+    }
+
+    size_t Footprint() const
+    {
+      size_t bytes = layers.capacity() * sizeof(Layer) + pieces.capacity() * sizeof(pieces[0]);
+      std::lock_guard<std::mutex> lock(pieceMutex);
+      for (const auto &piece : idlePieces) {
+	for (const auto &corners : piece->corners) {
+	  bytes += corners.capacity() * sizeof(Corner);
+	}
+	bytes += piece->indices.capacity() * sizeof(uint32_t);
+      }
+      return bytes;
+    }
+  };
+
+  // Build the sorted triangle index, unless it was already built for this surface generation
+  // `keys` is a working buffer, it can be kept across calls
+  // Returns 0 on success, -ECANCELED if cancelled, the index is then left empty
+  int Index(const MeshView &mesh, uint64_t generation, const CancellationToken &token, AlignedBuffer<SortKey> &keys)
+  {
+    if (generation == m_Generation and mesh.triangleCount == m_Order.size()) {
+      return 0;
+    }
+    m_Mesh = mesh;
+    m_Generation = generation;
+    m_Extent = {std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(),
+		-std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity()};
+    for (uint32_t v = 0; v < mesh.vertexCount; ++v) {
+      m_Extent = {std::min(m_Extent.minX, mesh.x[v]), std::min(m_Extent.minY, mesh.y[v]),
+		  std::max(m_Extent.maxX, mesh.x[v]), std::max(m_Extent.maxY, mesh.y[v])};
+    }
+    m_MaxHeight = 0.0;
+    m_Cache.clear();
+    m_CacheBytes = 0;
+    const uint32_t triangleCount = mesh.triangleCount;
+
+    keys.resize(triangleCount);
+    WorkerPool::Instance().ParallelFor(0, triangleCount, 1 << 16, [&](size_t begin, size_t end) {
+      for (size_t t = begin; t < end; ++t) {
+	const uint32_t *v = mesh.indices + 3 * t;
+	keys[t] = {std::min({mesh.z[v[0]], mesh.z[v[1]], mesh.z[v[2]]}), static_cast<uint32_t>(t)};
+      }
+    });
+    if (parallel_sort(keys.begin(), keys.end(), [](const SortKey &a, const SortKey &b) { return a.zmin < b.zmin; },
+		      token) != 0) {
+      m_Generation = 0;
+      m_Order.clear();
+      return -ECANCELED;
+    }
+
+    m_Order.resize(triangleCount);
+    m_ZMin.resize(triangleCount);
+    m_ZMax.resize(triangleCount);
+    std::mutex maxHeightMutex;
+    WorkerPool::Instance().ParallelFor(0, triangleCount, 1 << 16, [&](size_t begin, size_t end) {
+      double maxHeight = 0.0;
+      for (size_t i = begin; i < end; ++i) {
+	const uint32_t *v = mesh.indices + 3 * keys[i].triangle;
+	m_Order[i] = keys[i].triangle;
+	m_ZMin[i] = keys[i].zmin;
+	m_ZMax[i] = std::max({mesh.z[v[0]], mesh.z[v[1]], mesh.z[v[2]]});
+	maxHeight = std::max(maxHeight, m_ZMax[i] - m_ZMin[i]);
+      }
+      std::lock_guard<std::mutex> lock(maxHeightMutex);
+      m_MaxHeight = std::max(m_MaxHeight, maxHeight);
+    });
+    m_Top = triangleCount ? *std::max_element(m_ZMax.begin(), m_ZMax.end()) : 0.0;
+    return 0;
+  }
+
+  // Returns 0 on success, -errno on failure
+  int Slice(const LayerSettings &settings, const CancellationToken &token, LayerList &layers, Scratch &scratch)
+  {
+    layers.clear();
+    m_ReusedLayerCount = 0;
+    if (not (settings.liftThickness > 0.0)) {
+      return -EINVAL;
+    }
+    if (m_Order.empty()) {
+      return 0;
+    }
+    // Only the lifts the surface goes through. The lifts are counted from the base elevation both ways: the part
+    // of the surface below the base is sliced in lifts of negative index rather than dropped.
+    const double thickness = settings.liftThickness;
+    const double base = settings.baseElevation;
+    const int64_t first = static_cast<int64_t>(std::floor((m_ZMin[0] - base) / thickness));
+    const int64_t last = static_cast<int64_t>(std::floor((m_Top - base) / thickness));
+    if (last < first) {
+      return 0;
+    }
+    const size_t layerCount = std::min<int64_t>(last - first + 1, settings.maxLayerCount);
+    if (layerCount < static_cast<uint64_t>(last - first + 1)) {
+      LOG_WARNING("The surface spans ", last - first + 1, " lifts, only the lowest ", layerCount, " are sliced");
+    }
+    std::pmr::memory_resource *resource = m_Cache.get_allocator().resource();
+    std::vector<Layer> &sliced = scratch.layers;
+    sliced.clear();
+    sliced.resize(layerCount);
+    layers.resize(layerCount);
+    size_t missingCount = 0;
+    for (size_t k = 0; k < layerCount; ++k) {
+      const int64_t lift = first + static_cast<int64_t>(k);
+      sliced[k].bottom = base + lift * thickness;
+      sliced[k].top = base + (lift + 1) * thickness;
+      auto it = m_Cache.find(CacheKey(sliced[k].bottom, sliced[k].top));
+      if (it != m_Cache.end()) {
+	it->second.lastUse = ++m_UseCounter;
+	layers[k] = it->second.layer;
+	++m_ReusedLayerCount;
+      }
+      else {
+	++missingCount;
+      }
+    }
+    // Runs of missing layers, cut in more pieces than workers so that uneven pieces balance out
+    const size_t pieceLength = std::max<size_t>(1, missingCount / (4 * WorkerPool::Instance().WorkerCount()));
+    std::vector<std::pair<size_t, size_t>> &pieces = scratch.pieces;
+    pieces.clear();
+    for (size_t k = 0; k < layerCount; ++k) {
+      if (layers[k]) {
+	continue;
+      }
+      if (pieces.empty() or pieces.back().second != k or pieces.back().second - pieces.back().first == pieceLength) {
+	pieces.emplace_back(k, k);
+      }
+      ++pieces.back().second;
+    }
+    WorkerPool::Instance().ParallelFor(0, pieces.size(), 1, [&](size_t begin, size_t end) {
+      for (size_t piece = begin; piece < end and not token.IsCancellationRequested(); ++piece) {
+	SliceRange(pieces[piece].first, pieces[piece].second, sliced, scratch);
+      }
+    });
+    if (token.IsCancellationRequested()) {
+      // Partial layers must not end up in the cache
+      layers.clear();
+      sliced.clear();
+      return -ECANCELED;
+    }
+    for (size_t k = 0; k < layerCount; ++k) {
+      if (not layers[k]) {
+	layers[k] = std::allocate_shared<Layer>(std::pmr::polymorphic_allocator<Layer>(resource), std::move(sliced[k]));
+	m_CacheBytes += layers[k]->mesh.MemoryFootprint();
+	m_Cache[CacheKey(layers[k]->bottom, layers[k]->top)] = {layers[k], ++m_UseCounter};
+      }
+    }
+    sliced.clear();
+    TrimCache();
+    return 0;
+  }
+
+  // xy extent of the indexed surface, empty (min > max) before the first Index()
+  const Box2 &Extent() const
+  {
+    return m_Extent;
+  }
+
+  // Number of layers of the last Slice() that were found in the cache
+  size_t ReusedLayerCount() const
+  {
+    return m_ReusedLayerCount;
+  }
+
+  // Heap memory of the index and of the cached layers, some of which may also be referenced by the session
+  size_t MemoryFootprint() const
+  {
+    return m_Order.capacity() * sizeof(uint32_t) + (m_ZMin.capacity() + m_ZMax.capacity()) * sizeof(double) + m_CacheBytes;
+  }
+
+private:
+  static constexpr uint32_t kVertex = 0;
+  static constexpr uint32_t kBottom = 1;
+  static constexpr uint32_t kTop = 2;
+
+  struct CacheEntry
+  {
+    std::shared_ptr<const Layer> layer;
+    uint64_t lastUse;
+  };
+
+  // Lift bounds rounded to the micrometer, so that equal planes computed from different settings match
+  static std::pair<int64_t, int64_t> CacheKey(double bottom, double top)
+  {
+    return {std::llround(bottom * 1e6), std::llround(top * 1e6)};
+  }
+
+  // Evict the least recently used layers that only the cache references, while they take more than the budget
+  // Layers the session still references stay: evicting them would free nothing
+  void TrimCache()
+  {
+    auto unreferenced = [](const CacheEntry &entry) {
+      return entry.layer.use_count() == 1;
+    };
+    size_t unreferencedBytes = 0;
+    for (const auto &[key, entry] : m_Cache) {
+      if (unreferenced(entry)) {
+	unreferencedBytes += entry.layer->mesh.MemoryFootprint();
+      }
+    }
+    while (unreferencedBytes > kCacheBudget) {
+      auto oldest = m_Cache.end();
+      for (auto it = m_Cache.begin(); it != m_Cache.end(); ++it) {
+	if (unreferenced(it->second) and (oldest == m_Cache.end() or it->second.lastUse < oldest->second.lastUse)) {
+	  oldest = it;
+	}
+      }
+      const size_t bytes = oldest->second.layer->mesh.MemoryFootprint();
+      unreferencedBytes -= bytes;
+      m_CacheBytes -= bytes;
+      m_Cache.erase(oldest);
+    }
+  }
+
+  // Compute the layers [firstLayer, lastLayer), the group owns them: no synchronization needed
+  // The clipped triangles are collected as corners first, then each layer is built as an indexed mesh
+  void SliceRange(size_t firstLayer, size_t lastLayer, std::vector<Layer> &layers, Scratch &scratch) const
+  {
+    std::unique_ptr<PieceScratch> piece;
+    {
+      std::lock_guard<std::mutex> lock(scratch.pieceMutex);
+      if (not scratch.idlePieces.empty()) {
+	piece = std::move(scratch.idlePieces.back());
+	scratch.idlePieces.pop_back();
+      }
+    }
+    if (not piece) {
+      piece = std::make_unique<PieceScratch>();
+    }
+    while (piece->corners.size() < lastLayer - firstLayer) {
+      piece->corners.emplace_back(std::pmr::new_delete_resource());
+    }
+    const double bottom = layers[firstLayer].bottom;
+    const double top = layers[lastLayer - 1].top;
+    const double thickness = layers[firstLayer].top - layers[firstLayer].bottom;
+    const size_t begin = std::lower_bound(m_ZMin.begin(), m_ZMin.end(), bottom - m_MaxHeight) - m_ZMin.begin();
+    const size_t end = std::lower_bound(m_ZMin.begin() + begin, m_ZMin.end(), top) - m_ZMin.begin();
+    for (size_t i = begin; i < end; ++i) {
+      if (m_ZMax[i] < bottom) {
+	continue;
+      }
+      const uint32_t *v = m_Mesh.indices + 3 * m_Order[i];
+      const Point triangle[3] = {
+	{m_Mesh.x[v[0]], m_Mesh.y[v[0]], m_Mesh.z[v[0]], v[0], v[0], kVertex},
+	{m_Mesh.x[v[1]], m_Mesh.y[v[1]], m_Mesh.z[v[1]], v[1], v[1], kVertex},
+	{m_Mesh.x[v[2]], m_Mesh.y[v[2]], m_Mesh.z[v[2]], v[2], v[2], kVertex},
+      };
+      // Only the lifts spanned by the triangle
+      const size_t low = std::max<int64_t>(firstLayer, firstLayer + static_cast<int64_t>(std::floor((m_ZMin[i] - bottom) / thickness)));
+      const size_t high = std::min<int64_t>(lastLayer - 1, firstLayer + static_cast<int64_t>(std::floor((m_ZMax[i] - bottom) / thickness)));
+      for (size_t k = low; k <= high; ++k) {
+	Point polygon[5];
+	const int count = ClipToSlab(triangle, layers[k].bottom, layers[k].top, polygon);
+	AlignedBuffer<Corner> &corners = piece->corners[k - firstLayer];
+	for (int j = 1; j + 1 < count; ++j) {
+	  for (const Point *point : {&polygon[0], &polygon[j], &polygon[j + 1]}) {
+	    corners.push_back({*point, static_cast<uint32_t>(corners.size())});
+	  }
+	}
+      }
+    }
+    for (size_t k = firstLayer; k < lastLayer; ++k) {
+      BuildLayerMesh(piece->corners[k - firstLayer], piece->indices, layers[k].mesh);
+    }
+    std::lock_guard<std::mutex> lock(scratch.pieceMutex);
+    scratch.idlePieces.push_back(std::move(piece));
+  }
+
+  // Indexed mesh of the corners of a layer: the corners that come from the same surface vertex, or from the
+  // crossing of the same surface edge with the same plane, share their vertex
+  // Sorting by origin instead of hashing, the corners are left empty
+  static void BuildLayerMesh(AlignedBuffer<Corner> &corners, AlignedBuffer<uint32_t> &indices, Mesh &mesh)
+  {
+    auto origin = [](const Corner &corner) {
+      return std::tie(corner.point.a, corner.point.b, corner.point.plane);
+    };
+    std::sort(corners.begin(), corners.end(), [&](const Corner &l, const Corner &r) { return origin(l) < origin(r); });
+    uint32_t vertexCount = 0;
+    for (size_t i = 0; i < corners.size(); ++i) {
+      vertexCount += i == 0 or origin(corners[i]) != origin(corners[i - 1]);
+    }
+    mesh.Reserve(vertexCount, corners.size() / 3);
+    indices.resize(corners.size());
+    uint32_t vertex = Mesh::kInvalidIndex;
+    for (size_t i = 0; i < corners.size(); ++i) {
+      const Point &point = corners[i].point;
+      if (i == 0 or origin(corners[i]) != origin(corners[i - 1])) {
+	vertex = mesh.AddVertex(point.x, point.y, point.z);
+      }
+      indices[corners[i].position] = vertex;
+    }
+    mesh.AppendTriangles(indices.data(), indices.size() / 3);
+    corners.clear();
+    indices.clear();
+  }
+
+  // Clip a triangle to bottom <= z <= top (Sutherland-Hodgman against both planes)
+  // Returns the number of vertices of the resulting convex polygon, less than 3 when nothing is left
+  static int ClipToSlab(const Point (&triangle)[3], double bottom, double top, Point (&polygon)[5])
+  {
+    Point lower[4];
+    const int lowerCount = ClipToPlane(triangle, 3, bottom, +1.0, kBottom, lower);
+    return ClipToPlane(lower, lowerCount, top, -1.0, kTop, polygon);
+  }
+
+  // Keep the part of the polygon where side * (z - plane) >= 0
+  // A crossing is tagged with the surface edge its segment lies on: the polygon follows the triangle edges, and a
+  // segment between two crossings of the bottom plane never crosses the top one
+  static int ClipToPlane(const Point *in, int count, double plane, double side, uint32_t planeId, Point *out)
+  {
+    int outCount = 0;
+    for (int i = 0; i < count; ++i) {
+      const Point &a = in[i];
+      const Point &b = in[(i + 1) % count];
+      const double da = side * (a.z - plane);
+      const double db = side * (b.z - plane);
+      if (da >= 0.0) {
+	out[outCount++] = a;
+      }
+      if ((da < 0.0 and db > 0.0) or (da > 0.0 and db < 0.0)) {
+	const double t = da / (da - db);
+	const auto edge = a.a != a.b ? std::make_pair(a.a, a.b) : b.a != b.b ? std::make_pair(b.a, b.b)
+	  : std::make_pair(std::min(a.a, b.a), std::max(a.a, b.a));
+	out[outCount++] = {a.x + t * (b.x - a.x), a.y + t * (b.y - a.y), plane, edge.first, edge.second, planeId};
+      }
+    }
+    return outCount;
+  }
+
+  MeshView m_Mesh;
+  uint64_t m_Generation = 0;
+  Box2 m_Extent{std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(),
+		-std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity()};
+  AlignedBuffer<uint32_t> m_Order; // Triangles, sorted by lowest elevation
+  AlignedBuffer<double> m_ZMin;    // In sorted order
+  AlignedBuffer<double> m_ZMax;    // In sorted order
+  double m_MaxHeight = 0.0;
+  double m_Top = 0.0;
+  std::pmr::map<std::pair<int64_t, int64_t>, CacheEntry> m_Cache;
+  size_t m_CacheBytes = 0;
+  uint64_t m_UseCounter = 0;
+  size_t m_ReusedLayerCount = 0;
+};
+
+// Axis aligned 2D box, unbounded by default
+struct PreviewPoint
+{
+  double x, y, z;
+  uint32_t layer; // Index in the cut or fill layer list
+  bool fill;
+};
+
+// Level of detail point preview of a layer set
+// The layer vertices are bucketed by the cells of a quadtree over the extent of the sliced surfaces, in Morton
+// (Z-order) order, so that each cell, at every level, is a contiguous range of points. A query picks the quadtree
+// level at which the view box spans about budget / kPointsPerCell cells, and takes from each of them a strided
+// sample proportional to the cell population: strides along the Morton curve are spatially uniform.
+// The cost of a query is proportional to its output, whatever the number of points.
+// Each layer is sorted by cell once: a build reuses the sorted layers of the previous pyramid while the extent stays
+// the same, and only merges them, so that changing a few lifts only samples these again.
+class PreviewPyramid
+{
+public:
+  static constexpr int kFineLevel = 10; // 1024 x 1024 cells at the finest level
+  static constexpr size_t kPointsPerCell = 16;
+
+  explicit PreviewPyramid(std::pmr::memory_resource *resource = CurrentMemoryResource()):
+    m_Layers(resource)
+  {}
+
+  size_t PointCount() const
+  {
+    return m_Points.size();
+  }
+
+  // The sorted layers may be shared with the previous or the next pyramid
+  size_t MemoryFootprint() const
+  {
+    size_t bytes = m_Points.capacity() * sizeof(PreviewPoint) + m_CellOffsets.capacity() * sizeof(uint32_t);
+    for (const LayerCells &layer : m_Layers) {
+      bytes += layer.vertices->capacity() * sizeof(CellVertex);
+    }
+    return bytes;
+  }
+
+  // `extent` is the xy extent of the sliced surfaces, the layers of `previous` are reused if it is the same
+  // `cursors` is a working buffer, it can be kept across calls
+  // Returns 0 on success, -errno on failure
+  int Build(const Box2 &extent, const LayerList &cutLayers, const LayerList &fillLayers, const PreviewPyramid &previous,
+	    const CancellationToken &token, AlignedBuffer<uint32_t> &cursors)
+  {
+    m_Points.clear();
+    m_CellOffsets.clear();
+    m_Layers.clear();
+    if (not (extent.minX <= extent.maxX and extent.minY <= extent.maxY)) {
+      return 0;
+    }
+    m_MinX = extent.minX;
+    m_MinY = extent.minY;
+    m_ScaleX = extent.maxX > extent.minX ? 65536.0 / (extent.maxX - extent.minX) : 1.0;
+    m_ScaleY = extent.maxY > extent.minY ? 65536.0 / (extent.maxY - extent.minY) : 1.0;
+    const bool sameExtent = previous.m_MinX == m_MinX and previous.m_MinY == m_MinY and previous.m_ScaleX == m_ScaleX
+      and previous.m_ScaleY == m_ScaleY;
+
+    for (const LayerList *layers : {&cutLayers, &fillLayers}) {
+      for (const auto &layer : *layers) {
+	LayerCells cells{layer, nullptr};
+	for (const LayerCells &old : previous.m_Layers) {
+	  if (sameExtent and old.layer == layer) {
+	    cells.vertices = old.vertices;
+	    break;
+	  }
+	}
+	m_Layers.push_back(std::move(cells));
+      }
+    }
+    WorkerPool::Instance().ParallelFor(0, m_Layers.size(), 1, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end and not token.IsCancellationRequested(); ++i) {
+	if (not m_Layers[i].vertices) {
+	  m_Layers[i].vertices = SortByCell(m_Layers[i].layer->mesh);
+	}
+      }
+    });
+    if (token.IsCancellationRequested()) {
+      return -ECANCELED;
+    }
+
+    // Merge: count the points of each cell, then place the points of every layer at their cell cursor
+    m_CellOffsets.resize((size_t(1) << (2 * kFineLevel)) + 1);
+    std::fill(m_CellOffsets.begin(), m_CellOffsets.end(), 0);
+    for (const LayerCells &layer : m_Layers) {
+      for (const CellVertex &vertex : *layer.vertices) {
+	++m_CellOffsets[vertex.cell + 1];
+      }
+    }
+    for (size_t cell = 1; cell < m_CellOffsets.size(); ++cell) {
+      m_CellOffsets[cell] += m_CellOffsets[cell - 1];
+    }
+    m_Points.resize(m_CellOffsets[m_CellOffsets.size() - 1]);
+    cursors = m_CellOffsets;
+    for (size_t i = 0; i < m_Layers.size(); ++i) {
+      WorkerPool::Instance().Yield();
+      if (token.IsCancellationRequested()) {
+	return -ECANCELED;
+      }
+      const Mesh &mesh = m_Layers[i].layer->mesh;
+      const bool fill = i >= cutLayers.size();
+      const uint32_t index = static_cast<uint32_t>(fill ? i - cutLayers.size() : i);
+      for (const CellVertex &vertex : *m_Layers[i].vertices) {
+	const uint32_t v = vertex.vertex;
+	m_Points[cursors[vertex.cell]++] = {mesh.X()[v], mesh.Y()[v], mesh.Z()[v], index, fill};
+      }
+    }
+    return 0;
+  }
+
+  // Sample about `budget` points, uniformly spread over the part of the layers within `box`
+  void Query(const Box2 &box, size_t budget, AlignedBuffer<PreviewPoint> &points) const
+  {
+    points.clear();
+    if (m_Points.empty() or budget == 0) {
+      return;
+    }
+    const int fineCells = 1 << kFineLevel;
+    const double cellWidth = 65536.0 / fineCells / m_ScaleX;
+    const double cellHeight = 65536.0 / fineCells / m_ScaleY;
+    const double maxX = m_MinX + fineCells * cellWidth;
+    const double maxY = m_MinY + fineCells * cellHeight;
+    if (box.maxX < m_MinX or box.maxY < m_MinY or box.minX > maxX or box.minY > maxY) {
+      return;
+    }
+    const int fx0 = FineCoordinate(box.minX, m_MinX, m_ScaleX);
+    const int fy0 = FineCoordinate(box.minY, m_MinY, m_ScaleY);
+    const int fx1 = FineCoordinate(box.maxX, m_MinX, m_ScaleX);
+    const int fy1 = FineCoordinate(box.maxY, m_MinY, m_ScaleY);
+
+    // Finest level at which the box spans few enough cells
+    int level = kFineLevel;
+    for (; level > 0; --level) {
+      const int shift = kFineLevel - level;
+      const size_t cellCount = size_t((fx1 >> shift) - (fx0 >> shift) + 1) * ((fy1 >> shift) - (fy0 >> shift) + 1);
+      if (cellCount * kPointsPerCell <= budget) {
+	break;
+      }
+    }
+    const int shift = kFineLevel - level;
+    struct Cell
+    {
+      uint32_t begin, end;
+      double population; // Estimated number of points within the box
+      bool partial;      // Not fully within the box
+    };
+    std::vector<Cell> cells;
+    double total = 0.0;
+    for (int cy = fy0 >> shift; cy <= fy1 >> shift; ++cy) {
+      for (int cx = fx0 >> shift; cx <= fx1 >> shift; ++cx) {
+	const uint32_t code = MortonCode(cx, cy) << (2 * shift);
+	const uint32_t begin = m_CellOffsets[code];
+	const uint32_t end = m_CellOffsets[code + (uint32_t(1) << (2 * shift))];
+	if (begin == end) {
+	  continue;
+	}
+	const double x0 = m_MinX + (cx << shift) * cellWidth, x1 = x0 + (1 << shift) * cellWidth;
+	const double y0 = m_MinY + (cy << shift) * cellHeight, y1 = y0 + (1 << shift) * cellHeight;
+	const double overlap = std::max(0.0, std::min(x1, box.maxX) - std::max(x0, box.minX))
+	  * std::max(0.0, std::min(y1, box.maxY) - std::max(y0, box.minY)) / ((x1 - x0) * (y1 - y0));
+	const bool partial = overlap < 1.0;
+	cells.push_back({begin, end, (end - begin) * std::max(overlap, 1e-3), partial});
+	total += cells.back().population;
+      }
+    }
+    // Everything fits in the budget
+    const double ratio = std::min(1.0, budget / total);
+    points.reserve(std::min<size_t>(budget, static_cast<size_t>(total) + 1));
+    double carry = 0.0;
+    for (const Cell &cell : cells) {
+      const uint32_t count = cell.end - cell.begin;
+      uint32_t samples = count;
+      if (ratio < 1.0) {
+	// Error diffusion, so that the rounding of the per-cell quotas adds up to the budget
+	const double wanted = cell.population * ratio + carry;
+	const double quota = std::floor(wanted);
+	carry = wanted - quota;
+	// Partial cells draw over the whole cell, the samples outside the box are dropped
+	samples = static_cast<uint32_t>(std::min<double>(count, cell.partial ? std::ceil(quota * count / cell.population) : quota));
+      }
+      for (uint32_t i = 0; i < samples; ++i) {
+	const PreviewPoint &point = m_Points[cell.begin + (uint64_t(2 * i + 1) * count) / (2 * uint64_t(samples))];
+	if (not cell.partial or box.Contains(point.x, point.y)) {
+	  points.push_back(point);
+	}
+      }
+    }
+  }
+
+private:
+  struct CellVertex
+  {
+    uint32_t cell; // Finest level cell, by Morton index
+    uint32_t vertex;
+  };
+
+  // Vertices of a layer, sorted by cell
+  struct LayerCells
+  {
+    std::shared_ptr<const Layer> layer;
+    std::shared_ptr<const AlignedBuffer<CellVertex>> vertices;
+  };
+
+  std::shared_ptr<const AlignedBuffer<CellVertex>> SortByCell(const Mesh &mesh) const
+  {
+    auto vertices = std::allocate_shared<AlignedBuffer<CellVertex>>(
+      std::pmr::polymorphic_allocator<AlignedBuffer<CellVertex>>(CurrentMemoryResource()));
+    vertices->resize(mesh.VertexCount());
+    for (uint32_t v = 0; v < mesh.VertexCount(); ++v) {
+      const uint32_t code = MortonCode(Quantize(mesh.X()[v], m_MinX, m_ScaleX), Quantize(mesh.Y()[v], m_MinY, m_ScaleY));
+      (*vertices)[v] = {FineCell(code), v};
+    }
+    std::sort(vertices->begin(), vertices->end(), [](const CellVertex &a, const CellVertex &b) { return a.cell < b.cell; });
+    return vertices;
+  }
+
+  static uint32_t Quantize(double value, double min, double scale)
+  {
+    return static_cast<uint32_t>(std::min(65535.0, std::max(0.0, (value - min) * scale)));
+  }
+
+  static int FineCoordinate(double value, double min, double scale)
+  {
+    return static_cast<int>(Quantize(value, min, scale) >> (16 - kFineLevel));
+  }
+
+  static uint32_t FineCell(uint32_t code)
+  {
+    return code >> (2 * (16 - kFineLevel));
+  }
+
+  // Interleave the bits of x and y
+  static uint32_t MortonCode(uint32_t x, uint32_t y)
+  {
+    auto spread = [](uint32_t v) {
+      v = (v | (v << 8)) & 0x00FF00FF;
+      v = (v | (v << 4)) & 0x0F0F0F0F;
+      v = (v | (v << 2)) & 0x33333333;
+      v = (v | (v << 1)) & 0x55555555;
+      return v;
+    };
+    return spread(x) | (spread(y) << 1);
+  }
+
+  AlignedBuffer<PreviewPoint> m_Points; // Morton order
+  AlignedBuffer<uint32_t> m_CellOffsets; // First point of each finest level cell, by Morton index
+  std::pmr::vector<LayerCells> m_Layers; // Cut layers, then fill layers
+  double m_MinX = 0.0;
+  double m_MinY = 0.0;
+  double m_ScaleX = 1.0;
+  double m_ScaleY = 1.0;
+};
+
+// Uniform grid over the triangles of a surface, for xy point location and elevation sampling
+// Each cell lists the triangles whose bounding box overlaps it, all lists are packed in a single array.
+// Triangles are stored as precomputed barycentric coefficients relative to the grid origin, so
+// testing a candidate is a handful of multiply-adds. The candidates of a point are tested kLanes at a time in
+// branch-free lane loops that the compiler vectorizes.
+class SurfaceIndex
+{
+public:
+  static constexpr size_t kLanes = 8;
+
+  bool Empty() const
+  {
+    return m_CellOffsets.empty();
+  }
+
+  // `cursors` is a working buffer, it can be kept across calls
+  // Returns 0 on success, -errno on failure
+  int Build(const MeshView &mesh, const CancellationToken &token, AlignedBuffer<uint32_t> &cursors)
+  {
+    *this = SurfaceIndex();
+    if (mesh.triangleCount == 0) {
+      return 0;
+    }
+    double minX = mesh.x[0], maxX = mesh.x[0], minY = mesh.y[0], maxY = mesh.y[0], minZ = mesh.z[0];
+    for (uint32_t v = 1; v < mesh.vertexCount; ++v) {
+      minX = std::min(minX, mesh.x[v]);
+      maxX = std::max(maxX, mesh.x[v]);
+      minY = std::min(minY, mesh.y[v]);
+      maxY = std::max(maxY, mesh.y[v]);
+      minZ = std::min(minZ, mesh.z[v]);
+    }
+    m_OriginX = minX;
+    m_OriginY = minY;
+    m_OriginZ = minZ;
+    // About 2 triangles per cell
+    const double width = std::max(maxX - minX, 1e-3);
+    const double height = std::max(maxY - minY, 1e-3);
+    const double cellSize = std::sqrt(width * height / std::max<double>(1.0, mesh.triangleCount / 2.0));
+    m_Columns = std::max(1, std::min(1 << 13, static_cast<int>(std::ceil(width / cellSize))));
+    m_Rows = std::max(1, std::min(1 << 13, static_cast<int>(std::ceil(height / cellSize))));
+    m_CellWidth = width / m_Columns;
+    m_CellHeight = height / m_Rows;
+
+    const uint32_t triangleCount = mesh.triangleCount;
+    m_Ax.resize(triangleCount);
+    m_Ay.resize(triangleCount);
+    for (AlignedBuffer<float> *coefficients : {&m_Ux, &m_Uy, &m_Vx, &m_Vy, &m_Az, &m_Dzu, &m_Dzv}) {
+      coefficients->resize(triangleCount);
+    }
+    WorkerPool::Instance().ParallelFor(0, triangleCount, 1 << 16, [&](size_t begin, size_t end) {
+      for (size_t t = begin; t < end; ++t) {
+	const uint32_t *v = mesh.indices + 3 * t;
+	const double ax = mesh.x[v[0]] - m_OriginX, ay = mesh.y[v[0]] - m_OriginY;
+	const double e0x = mesh.x[v[1]] - mesh.x[v[0]], e0y = mesh.y[v[1]] - mesh.y[v[0]];
+	const double e1x = mesh.x[v[2]] - mesh.x[v[0]], e1y = mesh.y[v[2]] - mesh.y[v[0]];
+	const double det = e0x * e1y - e1x * e0y;
+	// Degenerate triangles never match: NaN fails every comparison
+	m_Ax[t] = det != 0.0 ? ax : std::numeric_limits<double>::quiet_NaN();
+	m_Ay[t] = ay;
+	m_Ux[t] = static_cast<float>(det != 0.0 ? e1y / det : 0.0);
+	m_Uy[t] = static_cast<float>(det != 0.0 ? -e1x / det : 0.0);
+	m_Vx[t] = static_cast<float>(det != 0.0 ? -e0y / det : 0.0);
+	m_Vy[t] = static_cast<float>(det != 0.0 ? e0x / det : 0.0);
+	m_Az[t] = static_cast<float>(mesh.z[v[0]] - m_OriginZ);
+	m_Dzu[t] = static_cast<float>(mesh.z[v[1]] - mesh.z[v[0]]);
+	m_Dzv[t] = static_cast<float>(mesh.z[v[2]] - mesh.z[v[0]]);
+      }
+    });
+    if (token.IsCancellationRequested()) {
+      return -ECANCELED;
+    }
+
+    // Bucket the triangles by the cells their bounding box overlaps, in two passes: count, then fill
+    auto forEachCell = [&](uint32_t t, auto &&fn) {
+      const uint32_t *v = mesh.indices + 3 * t;
+      const auto [x0, x1] = std::minmax({mesh.x[v[0]], mesh.x[v[1]], mesh.x[v[2]]});
+      const auto [y0, y1] = std::minmax({mesh.y[v[0]], mesh.y[v[1]], mesh.y[v[2]]});
+      const int c0 = Column(x0), c1 = Column(x1), r0 = Row(y0), r1 = Row(y1);
+      for (int r = r0; r <= r1; ++r) {
+	for (int c = c0; c <= c1; ++c) {
+	  fn(r * m_Columns + c);
+	}
+      }
+    };
+    // The passes are serial: they yield to interactive jobs and check for cancellation between chunks
+    auto forEachTriangle = [&](auto &&fn) {
+      for (uint32_t first = 0; first < triangleCount; first += kSerialChunk) {
+	WorkerPool::Instance().Yield();
+	if (token.IsCancellationRequested()) {
+	  return false;
+	}
+	const uint32_t last = std::min<uint32_t>(triangleCount, first + kSerialChunk);
+	for (uint32_t t = first; t < last; ++t) {
+	  fn(t);
+	}
+      }
+      return true;
+    };
+    m_CellOffsets.resize(size_t(m_Columns) * m_Rows + 1);
+    std::fill(m_CellOffsets.begin(), m_CellOffsets.end(), 0);
+    if (not forEachTriangle([&](uint32_t t) { forEachCell(t, [this](int cell) { ++m_CellOffsets[cell + 1]; }); })) {
+      return -ECANCELED;
+    }
+    for (size_t cell = 1; cell < m_CellOffsets.size(); ++cell) {
+      m_CellOffsets[cell] += m_CellOffsets[cell - 1];
+    }
+    m_CellTriangles.resize(m_CellOffsets[m_CellOffsets.size() - 1]);
+    cursors = m_CellOffsets;
+    if (not forEachTriangle([&](uint32_t t) { forEachCell(t, [&](int cell) { m_CellTriangles[cursors[cell]++] = t; }); })) {
+      return -ECANCELED;
+    }
+    return 0;
+  }
+
+  // Elevation of the surface at each (x, y), NaN where there is no surface
+  void SampleElevations(const double *x, const double *y, size_t count, double *z) const
+  {
+    for (size_t i = 0; i < count; ++i) {
+      const int cell = Empty() ? -1 : Cell(x[i], y[i]);
+      z[i] = cell < 0 ? std::numeric_limits<double>::quiet_NaN() : Locate(cell, x[i] - m_OriginX, y[i] - m_OriginY);
+    }
+  }
+
+  size_t MemoryFootprint() const
+  {
+    return (m_CellOffsets.capacity() + m_CellTriangles.capacity()) * sizeof(uint32_t)
+      + 2 * m_Ax.capacity() * sizeof(double) + 7 * m_Ux.capacity() * sizeof(float);
+  }
+
+private:
+  static constexpr uint32_t kSerialChunk = 1 << 16;
+
+  int Column(double x) const
+  {
+    return std::min(m_Columns - 1, std::max(0, static_cast<int>((x - m_OriginX) / m_CellWidth)));
+  }
+
+  int Row(double y) const
+  {
+    return std::min(m_Rows - 1, std::max(0, static_cast<int>((y - m_OriginY) / m_CellHeight)));
+  }
+
+  // Cell of a point, -1 outside of the grid
+  int Cell(double x, double y) const
+  {
+    const double cx = (x - m_OriginX) / m_CellWidth;
+    const double cy = (y - m_OriginY) / m_CellHeight;
+    if (not (cx >= 0.0 and cy >= 0.0 and cx <= m_Columns and cy <= m_Rows)) {
+      return -1;
+    }
+    return Row(y) * m_Columns + Column(x);
+  }
+
+  double Locate(int cell, double px, double py) const
+  {
+    constexpr float kEpsilon = 1e-5f;
+    const uint32_t begin = m_CellOffsets[cell];
+    const uint32_t end = m_CellOffsets[cell + 1];
+    for (uint32_t first = begin; first < end; first += kLanes) {
+      double ax[kLanes], ay[kLanes];
+      float u[kLanes], v[kLanes], ux[kLanes], uy[kLanes], vx[kLanes], vy[kLanes];
+      int inside[kLanes];
+      uint32_t triangles[kLanes];
+      // Gather, padding the last batch with its last candidate
+      for (size_t l = 0; l < kLanes; ++l) {
+	triangles[l] = m_CellTriangles[std::min<uint32_t>(first + l, end - 1)];
+	ax[l] = m_Ax[triangles[l]];
+	ay[l] = m_Ay[triangles[l]];
+	ux[l] = m_Ux[triangles[l]];
+	uy[l] = m_Uy[triangles[l]];
+	vx[l] = m_Vx[triangles[l]];
+	vy[l] = m_Vy[triangles[l]];
+      }
+      for (size_t l = 0; l < kLanes; ++l) {
+	// Offsets to the triangle in double, they would lose the precision of the coordinates in float
+	const float wx = static_cast<float>(px - ax[l]);
+	const float wy = static_cast<float>(py - ay[l]);
+	u[l] = wx * ux[l] + wy * uy[l];
+	v[l] = wx * vx[l] + wy * vy[l];
+	inside[l] = (u[l] >= -kEpsilon) & (v[l] >= -kEpsilon) & (u[l] + v[l] <= 1.0f + kEpsilon);
+      }
+      for (size_t l = 0; l < kLanes; ++l) {
+	if (inside[l]) {
+	  const uint32_t t = triangles[l];
+	  return m_OriginZ + m_Az[t] + double(u[l]) * m_Dzu[t] + double(v[l]) * m_Dzv[t];
+	}
+      }
+    }
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+
+  double m_OriginX = 0.0;
+  double m_OriginY = 0.0;
+  double m_OriginZ = 0.0;
+  double m_CellWidth = 1.0;
+  double m_CellHeight = 1.0;
+  int m_Columns = 0;
+  int m_Rows = 0;
+  AlignedBuffer<uint32_t> m_CellOffsets;
+  AlignedBuffer<uint32_t> m_CellTriangles;
+  // Per triangle: first vertex, barycentric coefficients and elevation gradient
+  AlignedBuffer<double> m_Ax, m_Ay;
+  AlignedBuffer<float> m_Ux, m_Uy, m_Vx, m_Vy, m_Az, m_Dzu, m_Dzv;
+};
+
+// The Processor class encapsulates all the mesh related operations
+// Operations are cancellable through the token they are given
+// Working buffers are kept from one operation to the next and grow to the size of the largest one, so that
+// operations on similar data don't allocate them again. Concurrent operations each lease their own set.
+class Processor
+{
+public:
+  Processor()
+  {
+    LOG("");
+  }
+
+  ~Processor()
+  {
+    LOG("");
+  }
+
+  // Forget the state of the previous session, keeping the working buffers
+  void Reset()
+  {
+    std::lock_guard<std::mutex> lock(m_ScratchMutex);
+    for (auto &scratch : m_IdleScratch) {
+      scratch->Clear();
+    }
+  }
+
+  size_t ScratchFootprint() const
+  {
+    std::lock_guard<std::mutex> lock(m_ScratchMutex);
+    size_t bytes = 0;
+    for (const auto &scratch : m_IdleScratch) {
+      bytes += scratch->Footprint();
+    }
+    return bytes;
+  }
+
+  // Mesh processing implementation goes here, to be used by the Session class
+  //
+  // ...
+  //
+
+  // Load a surface file, or generate a demo surface when no path is given
+  // Returns 0 on success, -errno on failure
+  int LoadSurface(SurfaceKind kind, const std::string &path, const CancellationToken &token, SurfaceData &surface)
+  {
+    if (path.empty()) {
+      DoStuff(token); // Simulate fetching the surface from the data service
+      if (token.IsCancellationRequested()) {
+	return -ECANCELED;
+      }
+      surface = SurfaceData(GenerateDemoSurface(kind));
+      return 0;
+    }
+    const std::string extension = path.substr(std::min(path.size(), path.rfind('.')));
+    if (extension == ".xml" or extension == ".csv" or extension == ".xyz" or extension == ".txt") {
+      Mesh mesh;
+      ScratchLease scratch(*this);
+      const int rc = extension == ".xml" ? SurfaceImporter::ImportLandXml(path, token, mesh, scratch->import)
+	: SurfaceImporter::ImportXyz(path, token, mesh, scratch->import);
+      if (rc == 0) {
+	surface = SurfaceData(std::move(mesh));
+      }
+      return rc;
+    }
+    return surface.MapTinFile(path, token);
+  }
+
+  // Design mesh of a cut (resp. fill) surface: the surface, not going below (resp. above) the critical surface
+  // Returns 0 on success, -errno on failure
+  int CreateDesign(const SurfaceIndex &critical, const MeshView &surface, SurfaceKind kind,
+		   const CancellationToken &token, Mesh &design)
+  {
+    design.Clear();
+    ScratchLease scratch(*this);
+    AlignedBuffer<double> &z = scratch->elevations;
+    z.resize(surface.vertexCount);
+    std::atomic<uint32_t> clampedCount{0};
+    WorkerPool::Instance().ParallelFor(0, surface.vertexCount, 1 << 14, [&](size_t begin, size_t end) {
+      if (token.IsCancellationRequested()) {
+	return;
+      }
+      critical.SampleElevations(surface.x + begin, surface.y + begin, end - begin, z.data() + begin);
+      uint32_t clamped = 0;
+      for (size_t v = begin; v < end; ++v) {
+	const double limit = z[v];
+	// No critical surface there: no constraint
+	z[v] = std::isnan(limit) ? surface.z[v] : kind == SurfaceKind::Cut ? std::max(surface.z[v], limit) : std::min(surface.z[v], limit);
+	clamped += z[v] != surface.z[v];
+      }
+      clampedCount += clamped;
+    });
+    if (token.IsCancellationRequested()) {
+      return -ECANCELED;
+    }
+    design.Reserve(surface.vertexCount, surface.triangleCount);
+    design.AppendVertices(surface.x, surface.y, z.data(), surface.vertexCount);
+    design.AppendTriangles(surface.indices, surface.triangleCount);
+    LOG(to_string(kind), ": ", clampedCount.load(), " vertices constrained by the critical surface");
+    return 0;
+  }
+
+  // Slice the surface in lifts, `slicer` holds the triangle index of the surface across calls
+  // Returns 0 on success, -errno on failure
+  int UpdateLayers(LayerSlicer &slicer, const MeshView &surface, uint64_t generation, const LayerSettings &settings,
+		   const CancellationToken &token, LayerList &layers)
+  {
+    ScratchLease scratch(*this);
+    int rc = slicer.Index(surface, generation, token, scratch->sortKeys);
+    if (rc != 0) {
+      return rc;
+    }
+    rc = slicer.Slice(settings, token, layers, scratch->slice);
+    if (rc == 0) {
+      LOG(slicer.ReusedLayerCount(), "/", layers.size(), " layers reused");
+    }
+    return rc;
+  }
+
+  // Returns 0 on success, -errno on failure
+  int BuildPreview(PreviewPyramid &preview, const Box2 &extent, const LayerList &cutLayers, const LayerList &fillLayers,
+		   const PreviewPyramid &previous, const CancellationToken &token)
+  {
+    ScratchLease scratch(*this);
+    return preview.Build(extent, cutLayers, fillLayers, previous, token, scratch->cellCursors);
+  }
+
+  // Returns 0 on success, -errno on failure
+  int BuildIndex(SurfaceIndex &index, const MeshView &surface, const CancellationToken &token)
+  {
+    ScratchLease scratch(*this);
+    return index.Build(surface, token, scratch->cellCursors);
+  }
+
+  // Regular grid over a 500 x 500 m site, with a different relief for each kind of surface
+  static Mesh GenerateDemoSurface(SurfaceKind kind)
+  {
+    constexpr uint32_t kSize = 512;
+    constexpr double kSpacing = 500.0 / (kSize - 1);
+    const double base = kind == SurfaceKind::Critical ? 95.0 : kind == SurfaceKind::Cut ? 100.0 : 90.0;
+    const double relief = kind == SurfaceKind::Critical ? 1.0 : 8.0;
+    Mesh mesh;
+    mesh.Reserve(kSize * kSize, 2 * (kSize - 1) * (kSize - 1));
+    for (uint32_t j = 0; j < kSize; ++j) {
+      for (uint32_t i = 0; i < kSize; ++i) {
+	const double x = i * kSpacing;
+	const double y = j * kSpacing;
+	mesh.AddVertex(x, y, base + relief * std::sin(x / 60.0) * std::cos(y / 45.0));
+      }
+    }
+    for (uint32_t j = 0; j + 1 < kSize; ++j) {
+      for (uint32_t i = 0; i + 1 < kSize; ++i) {
+	const uint32_t v = j * kSize + i;
+	mesh.AddTriangle(v, v + 1, v + kSize + 1);
+	mesh.AddTriangle(v, v + kSize + 1, v + kSize);
+      }
+    }
+    return mesh;
+  }
+
+  // Simulate a processing step that takes a few seconds to execute
+  // and that handle cancellation
+  void DoStuff(const CancellationToken &token)
+  {
+    for (int i=0; i<100; ++i) {
+      if (token.IsCancellationRequested()) {
+	return;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(random_int(15, 30)));
+    }
+  }
+
+private:
+  // Working buffers of one operation, allocated from the heap: they outlive the sessions and their arenas
+  struct Scratch
+  {
+    SurfaceImporter::Scratch import{std::pmr::new_delete_resource()};
+    AlignedBuffer<double> elevations{std::pmr::new_delete_resource()};
+    AlignedBuffer<LayerSlicer::SortKey> sortKeys{std::pmr::new_delete_resource()};
+    LayerSlicer::Scratch slice;
+    AlignedBuffer<uint32_t> cellCursors{std::pmr::new_delete_resource()};
+
+    void Clear()
+    {
+      import.result.Clear();
+      import.ranges.clear();
+      import.pointIndexes.clear();
+      import.indices.clear();
+      elevations.clear();
+      sortKeys.clear();
+      slice.Clear();
+      cellCursors.clear();
+    }
+
+    size_t Footprint() const
+    {
+      size_t bytes = import.buffer.capacity() + Footprint(import.result)
+	+ import.pointIndexes.capacity() * sizeof(import.pointIndexes[0]) + import.indices.capacity() * sizeof(uint32_t);
+      for (const auto &chunk : import.chunks) {
+	bytes += Footprint(chunk);
+      }
+      return bytes + elevations.capacity() * sizeof(double) + sortKeys.capacity() * sizeof(LayerSlicer::SortKey)
+	+ slice.Footprint()
+	+ cellCursors.capacity() * sizeof(uint32_t);
+    }
+
+    template <typename Chunk>
+    static size_t Footprint(const Chunk &chunk)
+    {
+      return (chunk.x.capacity() + chunk.y.capacity() + chunk.z.capacity()) * sizeof(double)
+	+ (chunk.pointIds.capacity() + chunk.faceIds.capacity()) * sizeof(uint64_t);
+    }
+  };
+
+  // Scratch set taken for the duration of an operation, and given back for the next one
+  class ScratchLease
+  {
+  public:
+    explicit ScratchLease(Processor &processor):
+      m_Processor(processor)
+    {
+      {
+	std::lock_guard<std::mutex> lock(processor.m_ScratchMutex);
+	if (not processor.m_IdleScratch.empty()) {
+	  m_Scratch = std::move(processor.m_IdleScratch.back());
+	  processor.m_IdleScratch.pop_back();
+	}
+      }
+      if (not m_Scratch) {
+	m_Scratch = std::make_unique<Scratch>();
+      }
+    }
+
+    ~ScratchLease()
+    {
+      std::lock_guard<std::mutex> lock(m_Processor.m_ScratchMutex);
+      m_Processor.m_IdleScratch.push_back(std::move(m_Scratch));
+    }
+
+    ScratchLease(const ScratchLease&) = delete;
+    ScratchLease &operator=(const ScratchLease&) = delete;
+
+    Scratch *operator->() const
+    {
+      return m_Scratch.get();
+    }
+
+  private:
+    Processor &m_Processor;
+    std::unique_ptr<Scratch> m_Scratch;
+  };
+
+  // As many sets as operations ran concurrently, most recently used last
+  mutable std::mutex m_ScratchMutex;
+  std::vector<std::unique_ptr<Scratch>> m_IdleScratch;
+};
+
+// Processors ready for new sessions
+// Starting a session takes a pre-constructed processor, whose working buffers are already sized from the
+// previous sessions. Processors come back when their session is destroyed, possibly from another thread.
+class ProcessorPool
+{
+public:
+  struct Recycler
+  {
+    ProcessorPool *pool;
+
+    void operator()(Processor *processor) const
+    {
+      pool->Recycle(processor);
+    }
+  };
+  using Handle = std::unique_ptr<Processor, Recycler>;
+
+  // `warmCount` processors are constructed upfront, at most `maxIdle` are kept when sessions end
+  explicit ProcessorPool(size_t warmCount = 2, size_t maxIdle = 4):
+    m_MaxIdle(std::max(warmCount, maxIdle))
+  {
+    for (size_t i = 0; i < warmCount; ++i) {
+      m_Idle.push_back(std::make_unique<Processor>());
+    }
+    m_CreatedCount = warmCount;
+  }
+
+  // Outstanding handles must be gone: they point back to the pool
+  ~ProcessorPool() = default;
+
+  Handle Acquire()
+  {
+    std::unique_ptr<Processor> processor;
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      if (not m_Idle.empty()) {
+	processor = std::move(m_Idle.back());
+	m_Idle.pop_back();
+      }
+    }
+    if (processor) {
+      ++m_ReusedCount;
+    } else {
+      processor = std::make_unique<Processor>();
+      ++m_CreatedCount;
+    }
+    return Handle(processor.release(), Recycler{this});
+  }
+
+  size_t CreatedCount() const
+  {
+    return m_CreatedCount;
+  }
+
+  size_t ReusedCount() const
+  {
+    return m_ReusedCount;
+  }
+
+  size_t IdleCount() const
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Idle.size();
+  }
+
+  // Working buffers held by the idle processors
+  size_t ScratchFootprint() const
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    size_t bytes = 0;
+    for (const auto &processor : m_Idle) {
+      bytes += processor->ScratchFootprint();
+    }
+    return bytes;
+  }
+
+private:
+  void Recycle(Processor *released)
+  {
+    std::unique_ptr<Processor> processor(released);
+    processor->Reset();
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (m_Idle.size() < m_MaxIdle) {
+      m_Idle.push_back(std::move(processor));
+    }
+  }
+
+  const size_t m_MaxIdle;
+  mutable std::mutex m_Mutex;
+  std::vector<std::unique_ptr<Processor>> m_Idle;
+  std::atomic<size_t> m_CreatedCount{0};
+  std::atomic<size_t> m_ReusedCount{0};
+};
+
+#if __cpp_impl_coroutine
+template <typename T>
+struct TaskResult
+{
+  T value{};
+
+  void return_value(T result)
+  {
+    value = std::move(result);
+  }
+
+  T Take()
+  {
+    return std::move(value);
+  }
+};
+
+template <>
+struct TaskResult<void>
+{
+  void return_void()
+  {}
+
+  void Take()
+  {}
+};
+
+// Lazily started coroutine, awaited by another coroutine or started with Detach()
+// Awaiting a task starts it, and the task resumes its awaiter by symmetric transfer when done: chains of
+// tasks don't grow the stack. Failures are returned as values like everywhere else, exceptions terminate.
+template <typename T = void>
+class Task
+{
+public:
+  struct promise_type;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  struct FinalAwaiter
+  {
+    bool await_ready() const noexcept
+    {
+      return false;
+    }
+
+    std::coroutine_handle<> await_suspend(Handle handle) const noexcept
+    {
+      promise_type &promise = handle.promise();
+      if (promise.detached) {
+	handle.destroy();
+	return std::noop_coroutine();
+      }
+      return promise.continuation ? promise.continuation : std::noop_coroutine();
+    }
+
+    void await_resume() const noexcept
+    {}
+  };
+
+  struct promise_type : TaskResult<T>
+  {
+    std::coroutine_handle<> continuation;
+    bool detached = false;
+
+    Task get_return_object()
+    {
+      return Task(Handle::from_promise(*this));
+    }
+
+    std::suspend_always initial_suspend() const noexcept
+    {
+      return {};
+    }
+
+    FinalAwaiter final_suspend() const noexcept
+    {
+      return {};
+    }
+
+    void unhandled_exception() const noexcept
+    {
+      std::terminate();
+    }
+  };
+
+  Task(Task &&other) noexcept:
+    m_Handle(std::exchange(other.m_Handle, nullptr))
+  {}
+
+  Task &operator=(Task&&) = delete;
+
+  ~Task()
+  {
+    if (m_Handle) {
+      m_Handle.destroy();
+    }
+  }
+
+  // Run the task without awaiting it, its frame is freed once it returns
+  void Detach() &&
+  {
+    Handle handle = std::exchange(m_Handle, nullptr);
+    handle.promise().detached = true;
+    handle.resume();
+  }
+
+  bool await_ready() const noexcept
+  {
+    return false;
+  }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+  {
+    m_Handle.promise().continuation = awaiting;
+    return m_Handle;
+  }
+
+  T await_resume()
+  {
+    return m_Handle.promise().Take();
+  }
+
+private:
+  explicit Task(Handle handle):
+    m_Handle(handle)
+  {}
+
+  Handle m_Handle;
+};
+#endif
+
+// The Session class provides an interface for executing lift layers operations.
+// It holds all the lift layer data, while relying on a Processor object to execute the operations asynchrounously. 
+// Operations go through a serial queue: each one starts once the completions of the previous ones were dispatched,
+// so that callbacks see the data as their operation left it. Operations that don't conflict on the data run
+// side by side, such as the loads of different surfaces, or a preview request while the design is created.
+class Session
+{
+public:
+  // Identifies an operation within a session, negative values denote a failure to start the operation
+  using OperationId = int;
+  using Timeout = std::chrono::milliseconds;
+
+  static constexpr Timeout kNoTimeout = Timeout::max();
+  static constexpr size_t kDefaultQueueDepth = 8;
+
+  // At most `queueDepth` operations wait behind the running ones
+  Session(ProcessorPool::Handle processor, CompletionQueue &completions, size_t queueDepth = kDefaultQueueDepth):
+    m_processor(std::move(processor)),
+    m_Completions(completions),
+    m_QueueDepth(queueDepth)
+  {
+    LOG("");
+  }
+
+  ~Session()
+  {
+    LOG("");
+    // Running jobs reference this session, wait for them to finish
+    std::unique_lock<std::mutex> lock(m_RunningMutex);
+    m_OperationDone.wait(lock, [this] { return m_RunningCount == 0; });
+  }
+
+  // Completion callback, `rc` is 0 on success or -errno on failure
+  // Called from the thread that dispatches the completion queue
+  // Move-only, captures of up to 48 bytes are stored without allocation
+  using Callback = UniqueFunction<void(const Session*, int rc)>;
+
+  // Returns the operation id, or -1 if the operation queue or the worker pool is full and the operation was not started
+  // Queued operations fail with -EBUSY if the worker pool is full when their turn comes
+  // The operation is cancelled and fails with -ETIMEDOUT if it didn't complete within `timeout` once started, time
+  // spent in the queue aside
+  // An empty `path` loads a generated demo surface
+  OperationId LoadSurface(SurfaceKind kind, const std::string &path, Callback callback, Timeout timeout = kNoTimeout)
+  {
+    LOG_ENTER();
+    const OperationId id = StartOperation(LoadSurfaceOperation(kind, path), std::move(callback), timeout);
+    LOG_EXIT();
+    return id;
+  }
+
+  // Slice the cut and fill meshes in lift layers
+  // Supersedes the layer updates still pending: they are cancelled, only the latest settings get computed
+  // Returns the operation id, or -1 if the operation queue or the worker pool is full
+  OperationId UpdateLayers(const LayerSettings &cutSettings, const LayerSettings &fillSettings, Callback callback,
+			   Timeout timeout = kNoTimeout)
+  {
+    LOG_ENTER();
+    const OperationId id = StartOperation(UpdateLayersOperation(cutSettings, fillSettings), std::move(callback), timeout);
+    LOG_EXIT();
+    return id;
+  }
+  
+  // Sample at most about `budget` layer points within `box`, see PreviewPoints()
+  // Supersedes the preview requests still pending, doesn't wait for a design being created
+  // Returns the operation id, or -1 if the operation queue or the worker pool is full
+  OperationId GetPreviewPoints(const Box2 &box, size_t budget, Callback callback, Timeout timeout = kNoTimeout)
+  {
+    LOG_ENTER();
+    const OperationId id = StartOperation(GetPreviewPointsOperation(box, budget), std::move(callback), timeout);
+    LOG_EXIT();
+    return id;
+  }
+  
+  // Derive the cut and fill meshes from their surfaces, constrained by the critical surface
+  // Runs as background work: interactive operations, of this session or others, get ahead of it
+  // Returns the operation id, or -1 if the operation queue or the worker pool is full
+  OperationId CreateDesign(Callback callback, Timeout timeout = kNoTimeout)
+  {
+    LOG_ENTER();
+    const OperationId id = StartOperation(CreateDesignOperation(), std::move(callback), timeout);
+    LOG_EXIT();
+    return id;
+  }
+
+  // Cancel every operation in progress, the ones that haven't started yet are dropped right away
+  // Operations started afterwards run normally
+  void Cancel()
+  {
+    LOG_ENTER();
+    m_CancelSource.Cancel();
+    m_CancelSource = CancellationSource();
+    WorkerPool::Instance().DropCancelled();
+    DropCancelledQueued();
+    LOG_EXIT();
+  }
+
+  // Cancel a single operation, returns false if it's not pending anymore
+  bool CancelOperation(OperationId id)
+  {
+    PendingOperation *operation = FindOperation(id);
+    if (not operation) {
+      return false;
+    }
+    operation->cancel.Cancel();
+    WorkerPool::Instance().DropCancelled();
+    DropCancelledQueued();
+    return true;
+  }
+
+  // Whether the operation was started and not reaped yet
+  bool IsOperationPending(OperationId id) const
+  {
+    return FindOperation(id) != nullptr;
+  }
+
+  const Mesh &CutMesh() const
+  {
+    return m_CutMesh;
+  }
+
+  const Mesh &FillMesh() const
+  {
+    return m_FillMesh;
+  }
+
+  const SurfaceData &Surface(SurfaceKind kind) const
+  {
+    switch (kind) {
+    case SurfaceKind::Critical:
+      return m_CriticalSurfaceData;
+    case SurfaceKind::Cut:
+      return m_CutSurfaceData;
+    case SurfaceKind::Fill:
+      break;
+    }
+    return m_FillSurfaceData;
+  }
+
+  const LayerList &CutLayers() const
+  {
+    return m_CutLayers;
+  }
+
+  const LayerList &FillLayers() const
+  {
+    return m_FillLayers;
+  }
+
+  // Result of the last GetPreviewPoints()
+  const AlignedBuffer<PreviewPoint> &PreviewPoints() const
+  {
+    return m_PreviewPoints;
+  }
+
+  bool HasPendingOperations()
+  {
+    return m_PendingCount != 0;
+  }
+
+  // Operations waiting for their turn in the serial queue
+  size_t QueuedOperationCount() const
+  {
+    return m_Queue.size();
+  }
+
+  // Operations cancelled because a newer request of the same kind came in
+  size_t SupersededCount() const
+  {
+    return m_SupersededCount;
+  }
+
+  // Memory mapped by the session arena, this is where the session data lives
+  // Can be read while operations run
+  size_t MemoryFootprint() const
+  {
+    return m_Arena.MappedBytes();
+  }
+
+  // Reap the operations whose completion was dispatched before their job returned
+  // Other operations are reaped when their completion is dispatched
+  void CheckPendingOperations()
+  {
+    for (size_t i = 0; i < m_AwaitingJobs.size(); ) {
+      PendingOperation &operation = m_Operations[m_AwaitingJobs[i]];
+      if (operation.done.load(std::memory_order_acquire)) {
+	LOG_DEBUG("ERASE DONE");
+	ReleaseOperation(m_AwaitingJobs[i]);
+	m_AwaitingJobs[i] = m_AwaitingJobs.back();
+	m_AwaitingJobs.pop_back();
+      }
+      else {
+	// Still pending, keep it and check the next one
+	LOG_DEBUG("KEEP");
+	++i;
+      }
+    }
+  }
+
+private:
+  SurfaceData &MutableSurface(SurfaceKind kind)
+  {
+    return const_cast<SurfaceData&>(Surface(kind));
+  }
+
+  // Whether the cut/fill meshes were derived from the surfaces currently loaded
+  bool HasDesign() const
+  {
+    return m_DesignGeneration != 0 and m_DesignSourceGenerations == m_SurfaceGenerations;
+  }
+
+  // The cut/fill mesh once derived, the loaded surface until then
+  MeshView SliceSource(SurfaceKind kind) const
+  {
+    const Mesh &mesh = kind == SurfaceKind::Cut ? m_CutMesh : m_FillMesh;
+    return HasDesign() ? mesh.View() : Surface(kind).View();
+  }
+
+  uint64_t SliceGeneration(SurfaceKind kind) const
+  {
+    return HasDesign() ? m_DesignGeneration : m_SurfaceGenerations[static_cast<size_t>(kind)];
+  }
+
+  // Spatial index of a surface, built on first use after each load
+  // Returns 0 on success, -errno on failure
+  int IndexOf(SurfaceKind kind, const CancellationToken &token, const SurfaceIndex *&index)
+  {
+    const size_t i = static_cast<size_t>(kind);
+    if (m_IndexGenerations[i] != m_SurfaceGenerations[i]) {
+      const int rc = m_processor->BuildIndex(m_SurfaceIndexes[i], Surface(kind).View(), token);
+      if (rc != 0) {
+	m_IndexGenerations[i] = 0;
+	return rc;
+      }
+      m_IndexGenerations[i] = m_SurfaceGenerations[i];
+    }
+    index = &m_SurfaceIndexes[i];
+    return 0;
+  }
+
+  using Work = UniqueFunction<int(const CancellationToken&), 64>;
+  struct PendingOperation;
+
+  // Parts of the session data, operations run at the same time when neither writes a part the other uses
+  using Footprint = uint32_t;
+  static constexpr Footprint kSurfaces = 0x7; // One bit per SurfaceKind
+  static constexpr Footprint kDesign = 1 << 3; // Cut and fill meshes, surface indexes
+  static constexpr Footprint kLayers = 1 << 4; // Layers, slicers and preview pyramid
+  static constexpr Footprint kPreview = 1 << 5; // Preview points
+  static constexpr Footprint kWholeSession = ~Footprint(0);
+
+  static Footprint SurfaceFootprint(SurfaceKind kind)
+  {
+    return Footprint(1) << static_cast<unsigned>(kind);
+  }
+
+  // Operations where only the latest request matters, a new one supersedes the pending ones of the same kind
+  enum class Coalescing : uint8_t
+  {
+    None,
+    Layers,
+    Preview,
+  };
+
+  struct Scheduling
+  {
+    Footprint reads = kWholeSession;
+    Footprint writes = kWholeSession;
+    Coalescing coalescing = Coalescing::None;
+    WorkerPool::Priority priority = WorkerPool::Priority::Interactive; // Background jobs yield to interactive ones
+  };
+
+  // What an operation does, and how it is scheduled
+  struct OperationSpec
+  {
+    Work work;
+    Scheduling scheduling;
+  };
+
+  OperationSpec LoadSurfaceOperation(SurfaceKind kind, const std::string &path)
+  {
+    return {[this, kind, path](const CancellationToken &token) {
+      SurfaceData surface;
+      int rc = m_processor->LoadSurface(kind, path, token, surface);
+      if (rc == 0 and token.IsCancellationRequested()) {
+	rc = -ECANCELED; // Too late, the result is dropped
+      }
+      if (rc == 0) {
+	MutableSurface(kind) = std::move(surface);
+	m_SurfaceGenerations[static_cast<size_t>(kind)] = ++m_GenerationCounter;
+      }
+      return rc;
+    }, {0, SurfaceFootprint(kind), Coalescing::None, WorkerPool::Priority::Interactive}};
+  }
+
+  OperationSpec UpdateLayersOperation(const LayerSettings &cutSettings, const LayerSettings &fillSettings)
+  {
+    return {[this, cutSettings, fillSettings](const CancellationToken &token) {
+      LayerList cutLayers(m_Arena.Resource()), fillLayers(m_Arena.Resource());
+      int rc = m_processor->UpdateLayers(m_CutSlicer, SliceSource(SurfaceKind::Cut), SliceGeneration(SurfaceKind::Cut),
+					 cutSettings, token, cutLayers);
+      if (rc == 0) {
+	rc = m_processor->UpdateLayers(m_FillSlicer, SliceSource(SurfaceKind::Fill), SliceGeneration(SurfaceKind::Fill),
+				       fillSettings, token, fillLayers);
+      }
+      // The preview is built once per layer set, queries are then cheap. It is kept as is when the slicer caches
+      // gave back the same layers, and else only samples the layers it doesn't have yet.
+      const bool sameLayers = cutLayers == m_CutLayers and fillLayers == m_FillLayers;
+      PreviewPyramid preview(m_Arena.Resource());
+      if (rc == 0 and not sameLayers) {
+	Box2 extent = m_CutSlicer.Extent();
+	const Box2 &fillExtent = m_FillSlicer.Extent();
+	extent = {std::min(extent.minX, fillExtent.minX), std::min(extent.minY, fillExtent.minY),
+		  std::max(extent.maxX, fillExtent.maxX), std::max(extent.maxY, fillExtent.maxY)};
+	rc = m_processor->BuildPreview(preview, extent, cutLayers, fillLayers, m_PreviewPyramid, token);
+      }
+      if (rc == 0 and token.IsCancellationRequested()) {
+	rc = -ECANCELED;
+      }
+      if (rc == 0) {
+	m_CutLayerSettings = cutSettings;
+	m_FillLayerSettings = fillSettings;
+	m_CutLayers = std::move(cutLayers);
+	m_FillLayers = std::move(fillLayers);
+	if (not sameLayers) {
+	  m_PreviewPyramid = std::move(preview);
+	}
+      }
+      return rc;
+    }, {kSurfaces | kDesign, kLayers, Coalescing::Layers, WorkerPool::Priority::Interactive}};
+  }
+
+  OperationSpec GetPreviewPointsOperation(const Box2 &box, size_t budget)
+  {
+    return {[this, box, budget](const CancellationToken &) {
+      m_PreviewPyramid.Query(box, budget, m_PreviewPoints);
+      return 0;
+    }, {kLayers, kPreview, Coalescing::Preview, WorkerPool::Priority::Interactive}};
+  }
+
+  OperationSpec CreateDesignOperation()
+  {
+    return {[this](const CancellationToken &token) {
+      const SurfaceIndex *critical = nullptr;
+      int rc = IndexOf(SurfaceKind::Critical, token, critical);
+      Mesh cutMesh, fillMesh;
+      if (rc == 0) {
+	rc = m_processor->CreateDesign(*critical, Surface(SurfaceKind::Cut).View(), SurfaceKind::Cut, token, cutMesh);
+      }
+      if (rc == 0) {
+	rc = m_processor->CreateDesign(*critical, Surface(SurfaceKind::Fill).View(), SurfaceKind::Fill, token, fillMesh);
+      }
+      if (rc == 0 and token.IsCancellationRequested()) {
+	rc = -ECANCELED;
+      }
+      if (rc == 0) {
+	m_CutMesh = std::move(cutMesh);
+	m_FillMesh = std::move(fillMesh);
+	m_DesignGeneration = ++m_GenerationCounter;
+	m_DesignSourceGenerations = m_SurfaceGenerations;
+      }
+      return rc;
+    }, {kSurfaces, kDesign, Coalescing::None, WorkerPool::Priority::Background}};
+  }
+
+#if __cpp_impl_coroutine
+public:
+  // Operation awaited by a coroutine running on the thread that dispatches the completions
+  // The operation starts when awaited, or before with Start() so that several run at once. The coroutine is
+  // resumed with the result, from the completion dispatch like a callback, and with -ECANCELED if the operation
+  // is cancelled, -ETIMEDOUT if it timed out, or -EBUSY if it couldn't be started. Destroying a started awaiter before it completed cancels
+  // the operation.
+  class OperationAwaiter
+  {
+  public:
+    OperationAwaiter(Session &session, OperationSpec spec, Timeout timeout, CancellationToken cancel):
+      m_Session(session),
+      m_Spec(std::move(spec)),
+      m_Timeout(timeout),
+      m_Cancel(std::move(cancel))
+    {}
+
+    OperationAwaiter(const OperationAwaiter&) = delete;
+    OperationAwaiter &operator=(const OperationAwaiter&) = delete;
+
+    ~OperationAwaiter()
+    {
+      if (m_Id >= 0 and not m_Done) {
+	m_Session.AbandonOperation(m_Id);
+      }
+    }
+
+    void Start()
+    {
+      if (m_Started) {
+	return;
+      }
+      m_Started = true;
+      m_Id = m_Session.StartOperation(std::move(m_Spec), [this](const Session*, int rc) {
+	m_Result = rc;
+	m_Done = true;
+	if (m_Awaiting) {
+	  std::exchange(m_Awaiting, nullptr).resume();
+	}
+      }, m_Timeout, m_Cancel, true);
+      if (m_Id < 0) {
+	m_Result = -EBUSY;
+	m_Done = true;
+      }
+    }
+
+    bool await_ready()
+    {
+      Start();
+      return m_Done;
+    }
+
+    // Completions are dispatched on this thread, the operation can't complete before the coroutine is suspended
+    void await_suspend(std::coroutine_handle<> awaiting)
+    {
+      m_Awaiting = awaiting;
+    }
+
+    int await_resume() const
+    {
+      return m_Result;
+    }
+
+  private:
+    Session &m_Session;
+    OperationSpec m_Spec;
+    Timeout m_Timeout;
+    CancellationToken m_Cancel;
+    OperationId m_Id = -1;
+    bool m_Started = false;
+    bool m_Done = false;
+    int m_Result = 0;
+    std::coroutine_handle<> m_Awaiting;
+  };
+
+  // Awaitable versions of the operations, `cancel` cancels the operation too, e.g. along with its pipeline
+  OperationAwaiter LoadSurfaceAsync(SurfaceKind kind, const std::string &path,
+				    CancellationToken cancel = CancellationToken(), Timeout timeout = kNoTimeout)
+  {
+    return OperationAwaiter(*this, LoadSurfaceOperation(kind, path), timeout, std::move(cancel));
+  }
+
+  OperationAwaiter UpdateLayersAsync(const LayerSettings &cutSettings, const LayerSettings &fillSettings,
+				     CancellationToken cancel = CancellationToken(), Timeout timeout = kNoTimeout)
+  {
+    return OperationAwaiter(*this, UpdateLayersOperation(cutSettings, fillSettings), timeout, std::move(cancel));
+  }
+
+  OperationAwaiter GetPreviewPointsAsync(const Box2 &box, size_t budget,
+					 CancellationToken cancel = CancellationToken(), Timeout timeout = kNoTimeout)
+  {
+    return OperationAwaiter(*this, GetPreviewPointsOperation(box, budget), timeout, std::move(cancel));
+  }
 
-// The Processor class encapsulates all the mesh related operations
-// Operations are cancellable
-class Processor
-{
-  std::atomic<bool> m_CancelRequested{false};
-  
-public:
-  Processor()
+  OperationAwaiter CreateDesignAsync(CancellationToken cancel = CancellationToken(), Timeout timeout = kNoTimeout)
   {
-    LOG("");
+    return OperationAwaiter(*this, CreateDesignOperation(), timeout, std::move(cancel));
   }
 
-  ~Processor()
+private:
+  // Cancel an operation whose result nobody waits for anymore, its callback is skipped
+  void AbandonOperation(OperationId id)
   {
-    LOG("");
+    PendingOperation *operation = FindOperation(id);
+    if (operation) {
+      operation->reportCancellation = false;
+      CancelOperation(id);
+    }
   }
+#endif
 
-  // Mesh processing implementation goes here, to be used by the Session class
-  //
-  // ...
-  //
+  // Run `work` on the worker pool, then post its result to the completion queue to call `callback`
+  // The operation waits in the serial queue until the ones before it are complete, or don't conflict with it
+  // The callback is skipped if the operation was cancelled by the time the completion is dispatched, unless
+  // `reportCancellation` is set: it is then called with -ECANCELED. `linked` cancels the operation as well.
+  // A superseded operation is always answered, with -ECANCELED. Its replacement takes its place in the queue.
+  // Reaching the timeout isn't a cancellation, the callback gets -ETIMEDOUT unless the job completed in time.
+  // Returns the operation id, or -1 if the queue or the worker pool is full and the operation was not started
+  OperationId StartOperation(OperationSpec spec, Callback callback, Timeout timeout,
+			     const CancellationToken &linked = CancellationToken(), bool reportCancellation = false)
+  {
+    const Scheduling &scheduling = spec.scheduling;
+    // The queued operations it supersedes make room for it
+    if (m_Queue.size() - SupersededQueuedCount(scheduling.coalescing) >= m_QueueDepth) {
+      LOG_WARNING("QUEUE FULL");
+      return -1;
+    }
+    // Keep track of the operation so that we can clean it up later when the work is done or is cancelled
+    // The work and the callback stay in there, jobs and completions only carry the operation
+    const uint32_t index = AcquireOperation();
+    if (index == kNoSlot) {
+      LOG_WARNING("REJECTED");
+      return -1;
+    }
+    PendingOperation *operation = &m_Operations[index];
+    // Per operation scope, linked to the session scope so that Cancel() reaches it
+    // The slot keeps its source, its state is reused once the previous operation is done with it
+    operation->cancel.Reset(m_CancelSource.Token(), linked);
+    operation->token = operation->cancel.Token();
+    operation->work = std::move(spec.work);
+    operation->callback = std::move(callback);
+    operation->scheduling = scheduling;
+    operation->reportCancellation = reportCancellation;
+    operation->timeout = timeout;
+    const OperationId id = operation->Id(index);
+    // Only supersede once the operation is admitted, a rejected request mustn't take the previous one down with it
+    if (not m_Queue.empty() or not CanLaunch(scheduling)) {
+      m_Queue.insert(m_Queue.begin() + QueuePosition(scheduling.coalescing), index);
+      Supersede(scheduling.coalescing, index);
+      return id;
+    }
+    if (not Launch(index)) {
+      ReleaseOperation(index);
+      return -1;
+    }
+    Supersede(scheduling.coalescing, index);
+    return id;
+  }
 
-  void Cancel()
+  // Queued operations that a new one of this kind would supersede
+  size_t SupersededQueuedCount(Coalescing coalescing) const
   {
-    m_CancelRequested = true;
+    if (coalescing == Coalescing::None) {
+      return 0;
+    }
+    return std::count_if(m_Queue.begin(), m_Queue.end(), [&](uint32_t index) {
+      const PendingOperation &operation = m_Operations[index];
+      return operation.scheduling.coalescing == coalescing and not operation.token.IsCancellationRequested();
+    });
   }
 
-  bool WasCancelled() const
+  // Where a new operation of this kind waits: in place of the earliest one it supersedes, so that the operations
+  // queued after that one still see its effect. Ahead of the queue if that one already runs, else at the end.
+  size_t QueuePosition(Coalescing coalescing) const
   {
-    return m_CancelRequested;
+    if (coalescing == Coalescing::None) {
+      return m_Queue.size();
+    }
+    const auto supersedes = [&](const PendingOperation &operation) {
+      return operation.scheduling.coalescing == coalescing and not operation.token.IsCancellationRequested();
+    };
+    for (const PendingOperation &operation : m_Operations) {
+      if (operation.pending and operation.launched and operation.work and supersedes(operation)) {
+	return 0;
+      }
+    }
+    const auto it = std::find_if(m_Queue.begin(), m_Queue.end(), [&](uint32_t index) {
+      return supersedes(m_Operations[index]);
+    });
+    return static_cast<size_t>(it - m_Queue.begin());
   }
-  
-  // Simulate a processing step that takes a few seconds to execute
-  // and that handle cancellation
-  void DoStuff()
+
+  // Cancel the operations of this kind that didn't complete yet, queued or running, but the `latest` one
+  // Running ones stop at their next cancellation check, queued ones leave the queue right away
+  void Supersede(Coalescing coalescing, uint32_t latest)
   {
-    for (int i=0; i<100; ++i) {
-      if (m_CancelRequested) {
-	return;
+    if (coalescing == Coalescing::None) {
+      return;
+    }
+    bool superseded = false;
+    for (uint32_t index = 0; index < m_Operations.size(); ++index) {
+      PendingOperation &operation = m_Operations[index];
+      // The work is released once the completion is dispatched
+      if (index != latest and operation.pending and operation.work and operation.scheduling.coalescing == coalescing
+	  and not operation.token.IsCancellationRequested()) {
+	LOG_DEBUG("SUPERSEDED");
+	operation.cancel.Cancel();
+	operation.superseded = true;
+	++m_SupersededCount;
+	superseded = true;
       }
-      std::this_thread::sleep_for(std::chrono::milliseconds(random_int(15, 30)));
+    }
+    if (superseded) {
+      WorkerPool::Instance().DropCancelled();
+      DropCancelledQueued();
     }
   }
 
-};
+  bool CanLaunch(const Scheduling &scheduling) const
+  {
+    // Launched operations, until their completion is dispatched and their work released
+    Footprint reads = 0, writes = 0;
+    for (const PendingOperation &operation : m_Operations) {
+      if (operation.pending and operation.launched and operation.work) {
+	reads |= operation.scheduling.reads;
+	writes |= operation.scheduling.writes;
+      }
+    }
+    return (scheduling.writes & (reads | writes)) == 0 and (scheduling.reads & writes) == 0;
+  }
 
-// The Session class provides an interface for executing lift layers operations.
-// It holds all the lift layer data, while relying on a Processor object to execute the operations asynchrounously. 
-class Session
-{
-public:
-  Session(std::unique_ptr<Processor> processor):
-    m_processor(std::move(processor))
+  // Submit the job of an operation to the worker pool, returns false if the pool is full
+  bool Launch(uint32_t index)
   {
-    LOG("");
+    PendingOperation *operation = &m_Operations[index];
+    const OperationId id = operation->Id(index);
+    if (operation->timeout != kNoTimeout) {
+      operation->cancel.CancelAfter(operation->timeout);
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_RunningMutex);
+      ++m_RunningCount;
+    }
+    const bool queued = WorkerPool::Instance().Enqueue([this, operation, id]() {
+      int rc;
+      {
+	// Everything the operation allocates belongs to the session
+	MemoryResourceScope scope(m_Arena.Resource());
+	rc = operation->work(operation->token);
+      }
+      FinishJob(operation, id, rc);
+    }, operation->token, [this, operation, id]() {
+      // Cancelled before it started
+      FinishJob(operation, id, -ECANCELED);
+    }, operation->scheduling.priority);
+    if (not queued) {
+      LOG_WARNING("REJECTED");
+      std::lock_guard<std::mutex> lock(m_RunningMutex);
+      --m_RunningCount;
+      return false;
+    }
+    operation->launched = true;
+    return true;
   }
 
-  ~Session()
+  // Launch the queued operations whose turn came, in order
+  void AdvanceQueue()
   {
-    LOG("");
+    DropCancelledQueued();
+    while (not m_Queue.empty() and CanLaunch(m_Operations[m_Queue.front()].scheduling)) {
+      const uint32_t index = m_Queue.front();
+      m_Queue.pop_front();
+      if (not Launch(index)) {
+	CompleteQueued(index, -EBUSY);
+      }
+    }
   }
 
-  int LoadSurface(int arg, std::function<void(const Session*)> callback)
+  // Queued operations are cancelled without waiting for their turn
+  void DropCancelledQueued()
   {
-    LOG_ENTER();
-    auto future_result = std::async(std::launch::async, [this, callback, arg]() {
-      m_processor->DoStuff(); // Should call real operations with parameters, ...
-      // Do not call the callback if we were cancelled while the operation was in progress
-      if (not m_processor->WasCancelled()) {
-	callback(this); // `this` can be used in the callback to access current session data
+    for (auto it = m_Queue.begin(); it != m_Queue.end(); ) {
+      if (m_Operations[*it].token.IsCancellationRequested()) {
+	CompleteQueued(*it, -ECANCELED);
+	it = m_Queue.erase(it);
       }
-    });
-    // Enqueue the future so that it's dtor doesn't block us here
-    // And we can clean it up later when the work is done or is cancelled
-    m_PendingFutures.push_back(std::move(future_result));
-    LOG_EXIT();
-    return 0;
+      else {
+	++it;
+      }
+    }
   }
-  
-  int UpdateLayers()
+
+  // Complete an operation that has no job
+  void CompleteQueued(uint32_t index, int rc)
   {
-    LOG_NOT_IMPLEMENTED();
-    return 0;
+    PendingOperation *operation = &m_Operations[index];
+    operation->done.store(true, std::memory_order_relaxed);
+    PostCompletion(operation, operation->Id(index), rc);
   }
-  
-  int GetPreviewPoints()
+
+  // The completion is embedded in the operation, which stays in its slot until the completion is dispatched
+  void PostCompletion(PendingOperation *operation, OperationId id, int rc)
   {
-    LOG_NOT_IMPLEMENTED();
-    return 0;
+    operation->completion.session = this;
+    operation->completion.id = id;
+    operation->completion.rc = rc;
+    m_Completions.Post(operation->completion);
   }
-  
-  int CreateDesign()
+
+  // Last thing an operation job does with the session
+  void FinishJob(PendingOperation *operation, OperationId id, int rc)
   {
-    LOG_NOT_IMPLEMENTED();
-    return 0;
+    // The operation is only reaped once its completion was dispatched and its job is done with it
+    PostCompletion(operation, id, rc);
+    // The session may be destroyed as soon as the lock is released
+    std::lock_guard<std::mutex> lock(m_RunningMutex);
+    operation->done.store(true, std::memory_order_release);
+    --m_RunningCount;
+    m_OperationDone.notify_all();
+    // Let the main loop reap the operation right away if its completion was already dispatched
+    m_Completions.Notify();
   }
 
-  void Cancel()
+  // Runs on the thread that dispatches the completion queue
+  void CompleteOperation(OperationId id, int rc)
   {
-    LOG_ENTER();
-    // Simply forward to the mesh processing object
-    m_processor->Cancel();
-    LOG_EXIT();
+    PendingOperation *operation = FindOperation(id);
+    if (not operation) {
+      return;
+    }
+    operation->work = nullptr;
+    // The job's rc tells whether it stopped on the deadline, the deadline itself may have passed since
+    if (not operation->token.IsCancelled()) {
+      // `this` can be used in the callback to access current session data
+      operation->callback(this, rc == -ECANCELED ? -ETIMEDOUT : rc);
+    }
+    else if (operation->reportCancellation or operation->superseded) {
+      operation->callback(this, -ECANCELED);
+    }
+    // The callback may have started other operations, but the slots don't move
+    operation->callback = nullptr;
+    const uint32_t index = static_cast<uint32_t>(id) & kSlotMask;
+    if (operation->done.load(std::memory_order_acquire)) {
+      ReleaseOperation(index);
+    }
+    else {
+      m_AwaitingJobs.push_back(index);
+    }
+    AdvanceQueue();
   }
 
-  bool HasPendingOperations()
+  // Operation record, in a slot map: the id is made of the slot index and of the slot generation, which changes
+  // every time the slot is reused so that stale ids aren't found
+  struct Completion: CompletionQueue::Node
+  {
+    Completion()
+    {
+      run = [](CompletionQueue::Node &node) {
+	Completion &completion = static_cast<Completion&>(node);
+	completion.session->CompleteOperation(completion.id, completion.rc);
+      };
+    }
+
+    Session *session = nullptr;
+    OperationId id = -1;
+    int rc = 0;
+  };
+
+  struct PendingOperation
+  {
+    uint32_t generation = 1;
+    bool pending = false;
+    std::atomic<bool> done{false}; // Set by the job once it doesn't touch the session anymore
+    bool launched = false; // Left the serial queue for the worker pool
+    Scheduling scheduling;
+    bool reportCancellation = false;
+    bool superseded = false; // Cancelled by a newer operation of the same kind, answered anyway
+    Timeout timeout = kNoTimeout; // Counted from the launch
+    CancellationSource cancel;
+    CancellationToken token;
+    Work work;
+    Callback callback;
+    Completion completion;
+
+    OperationId Id(uint32_t index) const
+    {
+      return static_cast<OperationId>(generation << kSlotBits | index);
+    }
+  };
+
+  static constexpr uint32_t kSlotBits = 16;
+  static constexpr uint32_t kSlotMask = (1u << kSlotBits) - 1;
+  static constexpr uint32_t kGenerationMask = (1u << (31 - kSlotBits)) - 1;
+  static constexpr uint32_t kNoSlot = ~0u;
+
+  uint32_t AcquireOperation()
   {
-    return not m_PendingFutures.empty();
+    uint32_t index;
+    if (not m_FreeSlots.empty()) {
+      index = m_FreeSlots.back();
+      m_FreeSlots.pop_back();
+    }
+    else if (m_Operations.size() <= kSlotMask) {
+      index = static_cast<uint32_t>(m_Operations.size());
+      m_Operations.emplace_back();
+    }
+    else {
+      return kNoSlot;
+    }
+    m_Operations[index].pending = true;
+    ++m_PendingCount;
+    return index;
   }
 
-  void CheckPendingOperations()
+  void ReleaseOperation(uint32_t index)
   {
-    for (auto it = m_PendingFutures.begin(); it != m_PendingFutures.end(); ) {
-      if (not it->valid()) {
-	// No shared state, it's safe to ignore
-	LOG("ERASE INVALID");
-	it = m_PendingFutures.erase(it);
-      }
-      else if (it->wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
-	// Operation is done, get rid of it
-	LOG("ERASE DONE");
-	it = m_PendingFutures.erase(it);
-      }
-      else {
-	// Still pending, keep it and check the next one
-	LOG("KEEP");
-	++it;
-      }
+    PendingOperation &operation = m_Operations[index];
+    operation.pending = false;
+    operation.done.store(false, std::memory_order_relaxed);
+    operation.launched = false;
+    operation.reportCancellation = false;
+    operation.superseded = false;
+    operation.generation = std::max(1u, (operation.generation + 1) & kGenerationMask);
+    operation.token = CancellationToken();
+    operation.work = nullptr;
+    operation.callback = nullptr;
+    m_FreeSlots.push_back(index);
+    --m_PendingCount;
+  }
+
+  PendingOperation *FindOperation(OperationId id)
+  {
+    return const_cast<PendingOperation*>(static_cast<const Session*>(this)->FindOperation(id));
+  }
+
+  const PendingOperation *FindOperation(OperationId id) const
+  {
+    if (id < 0) {
+      return nullptr;
+    }
+    const uint32_t index = static_cast<uint32_t>(id) & kSlotMask;
+    if (index >= m_Operations.size()) {
+      return nullptr;
+    }
+    const PendingOperation &operation = m_Operations[index];
+    if (not operation.pending or operation.Id(index) != id) {
+      return nullptr;
     }
+    return &operation;
   }
 
-private:
-  std::unique_ptr<Processor> m_processor;
-  std::list<std::future<void>> m_PendingFutures;
+  // First member, so that it is destroyed last: the session data is allocated from it
+  SessionArena m_Arena;
+  ProcessorPool::Handle m_processor;
+  CompletionQueue &m_Completions;
+  CancellationSource m_CancelSource;
+  // Pending operations, the deque keeps the slots in place as it grows
+  // The bookkeeping containers come from the arena as well
+  std::pmr::deque<PendingOperation> m_Operations{m_Arena.Resource()};
+  std::pmr::vector<uint32_t> m_FreeSlots{m_Arena.Resource()};
+  std::pmr::vector<uint32_t> m_AwaitingJobs{m_Arena.Resource()}; // Completion dispatched, job not done yet
+  size_t m_PendingCount = 0;
+  // Serial queue, only used from the thread that dispatches the completions
+  const size_t m_QueueDepth;
+  std::pmr::deque<uint32_t> m_Queue{m_Arena.Resource()}; // Operations waiting for their turn, in order
+  size_t m_SupersededCount = 0;
+  std::mutex m_RunningMutex;
+  std::condition_variable m_OperationDone;
+  size_t m_RunningCount = 0; // Guarded by m_RunningMutex
+  // Generations identify the successive versions of the surfaces and design meshes
+  std::atomic<uint64_t> m_GenerationCounter{0};
+  std::array<uint64_t, 3> m_SurfaceGenerations{};
+  std::array<uint64_t, 3> m_IndexGenerations{};
+  std::array<SurfaceIndex, 3> m_SurfaceIndexes;
+  uint64_t m_DesignGeneration = 0;
+  std::array<uint64_t, 3> m_DesignSourceGenerations{};
+  LayerSlicer m_CutSlicer{m_Arena.Resource()};
+  LayerSlicer m_FillSlicer{m_Arena.Resource()};
+  PreviewPyramid m_PreviewPyramid{m_Arena.Resource()};
+  AlignedBuffer<PreviewPoint> m_PreviewPoints;
 
   // These are the session data, as per Matthew document
   // Some need to be exposed so that the Mosaic handler can return them to the UI
@@ -196,12 +4744,12 @@ private:
   SurfaceData m_CutSurfaceData;
   LayerSettings m_CutLayerSettings;
   Mesh m_CutMesh;
-  std::list<Mesh> m_CutLayers;
+  LayerList m_CutLayers{m_Arena.Resource()};
   
   SurfaceData m_FillSurfaceData;
   LayerSettings m_FillLayerSettings;
   Mesh m_FillMesh;
-  std::list<Mesh> m_FillLayers;
+  LayerList m_FillLayers{m_Arena.Resource()};
 
 
   // Simulate a processing step that takes between 1 and 2 seconds to execute
@@ -214,96 +4762,435 @@ private:
 };
 
 
+// Bounds of the discarded sessions that are still winding down
+// The byte limit covers the ones waiting for the reclaimer as well
+struct GraveyardLimits
+{
+  size_t maxSessions = 4;
+  size_t maxBytes = size_t(1) << 30;
+};
+
 // A MOC of the Mosaic component
 // The role is to handle requests while delegating the business logic to the session class
 class MosaicComponent
 {
 public:
-  
-  void HandleBeginSessionRequest()
+  // Picked by the client, requests carry the id of the session they apply to
+  using SessionId = uint32_t;
+
+  // Surfaces loaded by the load request, indexed by SurfaceKind, empty paths load demo surfaces
+  // Requests of a session queue behind its running operations, up to `queueDepth` of them
+  explicit MosaicComponent(std::array<std::string, 3> surfacePaths = {}, GraveyardLimits graveyardLimits = {},
+			   size_t queueDepth = Session::kDefaultQueueDepth):
+    m_SurfacePaths(std::move(surfacePaths)),
+    m_GraveyardLimits(graveyardLimits),
+    m_QueueDepth(queueDepth),
+    m_Reclaimer([this] { m_Completions.Notify(); }) // Reclaimed memory may make room for a deferred discard
+  {}
+
+  // Starts a new session under `sessionId`, replacing the one that had this id
+  // The replaced session may have to wait for room in the graveyard first, see RequestDiscard()
+  void HandleBeginSessionRequest(SessionId sessionId)
   {
     LOG_ENTER();
-    if (m_CurrentSession) {
-      DiscardCurrentSession();
+    if (FindSession(sessionId)) {
+      RequestDiscard(sessionId, true);
+    }
+    else {
+      StartSession(sessionId);
     }
-    auto processor = std::make_unique<Processor>();
-    m_CurrentSession = std::make_unique<Session>(std::move(processor));
-    SendSuccessResponse("Session started");
     LOG_EXIT();
   }
 
-  void HandleEndSessionRequest()
+  void HandleEndSessionRequest(SessionId sessionId)
   {
     LOG_ENTER();
-    if (!m_CurrentSession) {
-      SendErrorResponse("No active session");
+    if (!FindSession(sessionId)) {
+      SendErrorResponse(sessionId, "No active session");
       return;
     }
-    DiscardCurrentSession();
-    SendSuccessResponse("Session stopped");
+    RequestDiscard(sessionId, false);
     LOG_EXIT();
   }
 
-  void HandleLoadSurfaceRequest()
+  void HandleLoadSurfaceRequest(SessionId sessionId)
   {
     LOG_ENTER();
-    if (!m_CurrentSession) {
-      SendErrorResponse("No active session");
+    Session *session = FindSession(sessionId);
+    if (!session) {
+      SendErrorResponse(sessionId, "No active session");
       return;
     }
-    if (m_CurrentSession->HasPendingOperations()) {
-      SendErrorResponse("Operation already in progress");
-      return;
+    for (SurfaceKind kind : {SurfaceKind::Critical, SurfaceKind::Cut, SurfaceKind::Fill}) {
+      const std::string &path = m_SurfacePaths[static_cast<size_t>(kind)]; // request.path
+      const auto id = session->LoadSurface(kind, path, [this, sessionId, kind] (const Session *session, int rc) -> void {
+	if (rc != 0) {
+	  SendErrorResponse(sessionId, std::string(to_string(kind)) + " surface not loaded: " + ErrorText(rc));
+	  return;
+	}
+	const MeshView surface = session->Surface(kind).View();
+	SendSuccessResponse(sessionId, std::string(to_string(kind)) + " surface loaded: " + std::to_string(surface.vertexCount)
+			    + " vertices, " + std::to_string(surface.triangleCount) + " triangles");
+      }, kRequestTimeout);
+      if (id < 0) {
+	SendErrorResponse(sessionId, "Too many operations in progress");
+	break;
+      }
     }
-    const int arg = 42; // request.arg
-    m_CurrentSession->LoadSurface(arg, [this] (const Session *session) -> void {
-      // data = session->GetSomeData()
-      // response.data = data
-      SendSuccessResponse("Surface loaded");
-    });
     LOG_EXIT();
   }
 
-  void HandleUpdateLayersRequest()
+  void HandleUpdateLayersRequest(SessionId sessionId)
   {
-    LOG_NOT_IMPLEMENTED();
+    LOG_ENTER();
+    Session *session = FindSession(sessionId);
+    if (!session) {
+      SendErrorResponse(sessionId, "No active session");
+      return;
+    }
+    LayerSettings cutSettings; // request.cut_settings
+    cutSettings.baseElevation = 80.0;
+    cutSettings.liftThickness = 0.5;
+    LayerSettings fillSettings; // request.fill_settings
+    fillSettings.baseElevation = 80.0;
+    fillSettings.liftThickness = 0.3;
+    const auto id = session->UpdateLayers(cutSettings, fillSettings, [this, sessionId] (const Session *session, int rc) -> void {
+      if (rc != 0) {
+	SendErrorResponse(sessionId, std::string("Layers not updated: ") + ErrorText(rc));
+	return;
+      }
+      size_t triangleCount = 0;
+      for (const auto *layers : {&session->CutLayers(), &session->FillLayers()}) {
+	for (const auto &layer : *layers) {
+	  triangleCount += layer->mesh.TriangleCount();
+	}
+      }
+      SendSuccessResponse(sessionId, "Layers updated: " + std::to_string(session->CutLayers().size()) + " cut layers, "
+			  + std::to_string(session->FillLayers().size()) + " fill layers, "
+			  + std::to_string(triangleCount) + " triangles");
+    }, kRequestTimeout);
+    if (id < 0) {
+      SendErrorResponse(sessionId, "Too many operations in progress");
+    }
+    LOG_EXIT();
   }
   
-  void HandleGetPreviewPointsRequest()
+  void HandleGetPreviewPointsRequest(SessionId sessionId)
+  {
+    LOG_ENTER();
+    Session *session = FindSession(sessionId);
+    if (!session) {
+      SendErrorResponse(sessionId, "No active session");
+      return;
+    }
+    const Box2 view; // request.view
+    const size_t budget = 100000; // request.budget
+    const auto id = session->GetPreviewPoints(view, budget, [this, sessionId] (const Session *session, int rc) -> void {
+      if (rc != 0) {
+	SendErrorResponse(sessionId, std::string("No preview points: ") + ErrorText(rc));
+	return;
+      }
+      // response.points = session->PreviewPoints()
+      SendSuccessResponse(sessionId, std::to_string(session->PreviewPoints().size()) + " preview points");
+    }, kRequestTimeout);
+    if (id < 0) {
+      SendErrorResponse(sessionId, "Too many operations in progress");
+    }
+    LOG_EXIT();
+  }
+
+  void HandleCreateDesignRequest(SessionId sessionId)
+  {
+    LOG_ENTER();
+    Session *session = FindSession(sessionId);
+    if (!session) {
+      SendErrorResponse(sessionId, "No active session");
+      return;
+    }
+    const auto id = session->CreateDesign([this, sessionId] (const Session *session, int rc) -> void {
+      if (rc != 0) {
+	SendErrorResponse(sessionId, std::string("Design not created: ") + ErrorText(rc));
+	return;
+      }
+      SendSuccessResponse(sessionId, "Design created: " + std::to_string(session->CutMesh().TriangleCount()) + " cut triangles, "
+			  + std::to_string(session->FillMesh().TriangleCount()) + " fill triangles");
+    }, kRequestTimeout);
+    if (id < 0) {
+      SendErrorResponse(sessionId, "Too many operations in progress");
+    }
+    LOG_EXIT();
+  }
+
+#if __cpp_impl_coroutine
+  // Load the surfaces, update the layers and get the preview points, as a single request
+  // A new pipeline request cancels the one still running in the same session
+  void HandlePipelineRequest(SessionId sessionId)
+  {
+    LOG_ENTER();
+    Session *session = FindSession(sessionId);
+    if (!session) {
+      SendErrorResponse(sessionId, "No active session");
+      return;
+    }
+    CancellationSource &pipelineCancel = m_PipelineCancels[sessionId];
+    pipelineCancel.Cancel();
+    pipelineCancel = CancellationSource();
+    RunPipeline(sessionId, *session, pipelineCancel.Token()).Detach();
+    LOG_EXIT();
+  }
+#endif
+
+  void HandleGetStatisticsRequest()
   {
-    LOG_NOT_IMPLEMENTED();
+    // One response per group, a single line wouldn't fit in a log record
+    const WorkerPool &pool = WorkerPool::Instance();
+    std::ostringstream stats;
+    stats << "workers=" << pool.WorkerCount()
+	  << " queue_depth=" << pool.QueueDepth() << "/" << pool.QueueCapacity()
+	  << " rejected=" << pool.RejectedCount()
+	  << " stolen=" << pool.StolenCount()
+	  << " dropped=" << pool.DroppedCount()
+	  << " yielded=" << pool.YieldedCount()
+	  << " log_dropped=" << Logger::Instance().DroppedCount();
+    SendSuccessResponse(stats.str());
+    stats.str("");
+    size_t sessionBytes = 0;
+    for (const auto &entry : m_Sessions) {
+      sessionBytes += entry.second->MemoryFootprint();
+    }
+    stats << "sessions=" << m_Sessions.size()
+	  << " session_bytes=" << sessionBytes
+	  << " graveyard=" << m_DiscardedSessions.size() << "/" << m_GraveyardLimits.maxSessions
+	  << " graveyard_bytes=" << GraveyardBytes() << "/" << m_GraveyardLimits.maxBytes
+	  << " deferred=" << m_DeferredDiscardCount
+	  << " rejected_discards=" << m_RejectedDiscardCount;
+    SendSuccessResponse(stats.str());
+    stats.str("");
+    stats << "reclaimed=" << m_Reclaimer.ReclaimedCount() << " reclaim_pending=" << m_Reclaimer.PendingCount()
+	  << " reclaim_bytes=" << m_Reclaimer.PendingBytes()
+	  << " quiesced=" << m_QuiescedCount
+	  << " quiesce_ms(last/avg/max)=" << m_LastQuiesceTime.count() << "/"
+	  << (m_QuiescedCount ? m_TotalQuiesceTime.count() / m_QuiescedCount : 0) << "/" << m_MaxQuiesceTime.count();
+    SendSuccessResponse(stats.str());
+    stats.str("");
+    stats << "processors(created/reused/idle)=" << m_Processors.CreatedCount() << "/" << m_Processors.ReusedCount()
+	  << "/" << m_Processors.IdleCount()
+	  << " scratch_bytes=" << m_Processors.ScratchFootprint();
+    SendSuccessResponse(stats.str());
+    for (const auto &entry : m_Sessions) {
+      stats.str("");
+      stats << "bytes=" << entry.second->MemoryFootprint()
+	    << " queued=" << entry.second->QueuedOperationCount() << "/" << m_QueueDepth
+	    << " superseded=" << entry.second->SupersededCount();
+      SendSuccessResponse(entry.first, stats.str());
+    }
   }
 
-  void HandleCreateDesignRequest()
+  // File descriptor that becomes readable when an operation finished, to be polled by the main loop
+  int CompletionFd() const
   {
-    LOG_NOT_IMPLEMENTED();
+    return m_Completions.Fd();
   }
 
-  void HandlePeriodicTasks()
+  void HandleCompletedOperations()
   {
-    // Cleanup all futures to free resources
-    // 1. Current session
-    if (m_CurrentSession) {
-      m_CurrentSession->CheckPendingOperations();
+    // Responses are sent from here, in completion order
+    m_Completions.Dispatch();
+    // Cleanup all finished tasks to free resources
+    // 1. Active sessions
+    for (auto &entry : m_Sessions) {
+      entry.second->CheckPendingOperations();
     }
     // 2. All discarded sessions
+    ReapDiscardedSessions();
+    // Which may have made room for the sessions waiting to be discarded
+    AdmitDeferredDiscards();
+  }
+
+  // How long the main loop may wait for an event, in ms, -1 for no limit
+  int PollTimeout() const
+  {
+    if (m_DeferredDiscards.empty()) {
+      return -1;
+    }
+    const auto left = std::chrono::ceil<std::chrono::milliseconds>(m_DeferredDiscards.front().deadline
+								    - std::chrono::steady_clock::now());
+    return static_cast<int>(std::max<std::chrono::milliseconds::rep>(0, left.count()));
+  }
+
+  // Reject the discard requests that waited too long for room in the graveyard
+  void HandleTimeouts()
+  {
+    const auto now = std::chrono::steady_clock::now();
+    bool rejected = false;
+    while (not m_DeferredDiscards.empty() and m_DeferredDiscards.front().deadline <= now) {
+      const SessionId sessionId = m_DeferredDiscards.front().sessionId;
+      m_DeferredDiscards.pop_front();
+      ++m_RejectedDiscardCount;
+      SendErrorResponse(sessionId, "Too many sessions winding down, try again later");
+      rejected = true;
+    }
+    if (rejected) {
+      AdmitDeferredDiscards(); // The next ones may not need as much room
+    }
+  }
+
+private:
+  // The UI gives up on a request after this delay, don't keep working on it past that point
+  static constexpr Session::Timeout kRequestTimeout{10000};
+  // How long a begin or end request waits for room in the graveyard before it is rejected
+  static constexpr Session::Timeout kDiscardWaitTimeout{200};
+
+#if __cpp_impl_coroutine
+  // Runs on the main loop thread, each step starts from the completion of the previous one
+  // Stops at the first failure. A cancelled pipeline answers as well: a newer pipeline request, the end of the
+  // session or a newer request of one of its steps cancels it, and the client still waits for an answer.
+  Task<> RunPipeline(SessionId sessionId, Session &session, CancellationToken cancel)
+  {
+    const auto start = std::chrono::steady_clock::now();
+    Session::OperationAwaiter critical = session.LoadSurfaceAsync(SurfaceKind::Critical, m_SurfacePaths[0], cancel,
+								   kRequestTimeout);
+    Session::OperationAwaiter cut = session.LoadSurfaceAsync(SurfaceKind::Cut, m_SurfacePaths[1], cancel, kRequestTimeout);
+    Session::OperationAwaiter fill = session.LoadSurfaceAsync(SurfaceKind::Fill, m_SurfacePaths[2], cancel, kRequestTimeout);
+    // The surfaces load at once
+    critical.Start();
+    cut.Start();
+    fill.Start();
+    int rc = co_await critical;
+    if (rc == 0) {
+      rc = co_await cut;
+    }
+    if (rc == 0) {
+      rc = co_await fill;
+    }
+    if (rc == 0) {
+      LayerSettings cutSettings; // request.cut_settings
+      cutSettings.baseElevation = 80.0;
+      cutSettings.liftThickness = 0.5;
+      LayerSettings fillSettings; // request.fill_settings
+      fillSettings.baseElevation = 80.0;
+      fillSettings.liftThickness = 0.3;
+      rc = co_await session.UpdateLayersAsync(cutSettings, fillSettings, cancel, kRequestTimeout);
+    }
+    if (rc == 0) {
+      const Box2 view; // request.view
+      const size_t budget = 100000; // request.budget
+      rc = co_await session.GetPreviewPointsAsync(view, budget, cancel, kRequestTimeout);
+    }
+    if (rc == -ECANCELED) {
+      SendErrorResponse(sessionId, "Pipeline cancelled");
+      co_return;
+    }
+    if (rc != 0) {
+      SendErrorResponse(sessionId, std::string("Pipeline failed: ") + std::strerror(-rc));
+      co_return;
+    }
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    SendSuccessResponse(sessionId, "Pipeline done in " + std::to_string(elapsed.count()) + " ms: "
+			+ std::to_string(session.CutLayers().size() + session.FillLayers().size()) + " layers, "
+			+ std::to_string(session.PreviewPoints().size()) + " preview points");
+  }
+#endif
+
+  Session *FindSession(SessionId sessionId)
+  {
+    auto it = m_Sessions.find(sessionId);
+    return it != m_Sessions.end() ? it->second.get() : nullptr;
+  }
+
+  void ReapDiscardedSessions()
+  {
     for (auto it = m_DiscardedSessions.begin(); it != m_DiscardedSessions.end(); ) {
-      (*it)->CheckPendingOperations();
-      if ((*it)->HasPendingOperations()) {
-	LOG("KEEP");
+      it->session->CheckPendingOperations();
+      if (it->session->HasPendingOperations()) {
+	LOG_DEBUG("KEEP");
 	++it;
       }
       else {
-	LOG("ERASE DONE");
+	LOG_DEBUG("ERASE DONE");
+	RecordQuiesceTime(std::chrono::steady_clock::now() - it->discardedAt);
+	const size_t bytes = it->session->MemoryFootprint();
+	m_Reclaimer.Retire(std::move(it->session), bytes);
 	it = m_DiscardedSessions.erase(it);
       }
     }    
   }
-  
-private:
+
+  size_t GraveyardBytes() const
+  {
+    size_t bytes = 0;
+    for (const auto &discarded : m_DiscardedSessions) {
+      bytes += discarded.session->MemoryFootprint();
+    }
+    return bytes;
+  }
+
+  // Admission control for discarding `session`
+  // Its memory adds up with the one of the graveyard and of the reclaimer queue, and with operations still running
+  // it has to fit in the graveyard
+  bool HasRoomForDiscard(Session &session)
+  {
+    const size_t reclaimBytes = m_Reclaimer.PendingBytes();
+    if (m_DiscardedSessions.empty() and reclaimBytes == 0) {
+      return true; // Always room for one
+    }
+    if (GraveyardBytes() + reclaimBytes + session.MemoryFootprint() > m_GraveyardLimits.maxBytes) {
+      return false;
+    }
+    return not session.HasPendingOperations() or m_DiscardedSessions.size() < m_GraveyardLimits.maxSessions;
+  }
+
+  // Discard the session now if the graveyard has room for it, or else once the discarded sessions (cancelled
+  // already) wound down enough, without blocking the main loop. The session carries on in the meantime.
+  // The request fails if that takes longer than kDiscardWaitTimeout, see HandleTimeouts().
+  // `restart` starts a new session under the same id once the old one is discarded.
+  void RequestDiscard(SessionId sessionId, bool restart)
+  {
+    const bool waiting = std::any_of(m_DeferredDiscards.begin(), m_DeferredDiscards.end(),
+				     [&](const DeferredDiscard &deferred) { return deferred.sessionId == sessionId; });
+    if (waiting) {
+      ++m_RejectedDiscardCount;
+      SendErrorResponse(sessionId, "Session already waiting to wind down, try again later");
+      return;
+    }
+    m_DeferredDiscards.push_back({sessionId, restart, std::chrono::steady_clock::now() + kDiscardWaitTimeout});
+    AdmitDeferredDiscards();
+    if (not m_DeferredDiscards.empty() and m_DeferredDiscards.back().sessionId == sessionId) {
+      LOG_WARNING("Graveyard full, waiting for the discarded sessions to wind down");
+      ++m_DeferredDiscardCount;
+    }
+  }
+
+  // Complete the deferred discard requests in order, as long as the graveyard has room
+  void AdmitDeferredDiscards()
+  {
+    while (not m_DeferredDiscards.empty()) {
+      const DeferredDiscard deferred = m_DeferredDiscards.front();
+      // Only discarded from here, the session is still there
+      if (not HasRoomForDiscard(*FindSession(deferred.sessionId))) {
+	return;
+      }
+      m_DeferredDiscards.pop_front();
+      DiscardSession(deferred.sessionId);
+      if (deferred.restart) {
+	StartSession(deferred.sessionId);
+      }
+      else {
+	SendSuccessResponse(deferred.sessionId, "Session stopped");
+      }
+    }
+  }
+
+  void StartSession(SessionId sessionId)
+  {
+    auto processor = m_Processors.Acquire();
+    m_Sessions[sessionId] = std::make_unique<Session>(std::move(processor), m_Completions, m_QueueDepth);
+    SendSuccessResponse(sessionId, "Session started");
+  }
+
   void SendErrorResponse(const std::string &message)
   {
-    LOG(message);
+    LOG_ERROR(message);
   }
 
   void SendSuccessResponse(const std::string &message)
@@ -311,79 +5198,187 @@ private:
     LOG(message);
   }
 
-  void DiscardCurrentSession()
+  void SendErrorResponse(SessionId sessionId, const std::string &message)
+  {
+    LOG_ERROR("session ", sessionId, ": ", message);
+  }
+
+  // Session callbacks only get -ECANCELED when a newer request of the same kind took over
+  static const char *ErrorText(int rc)
+  {
+    return rc == -ECANCELED ? "superseded by a newer request" : std::strerror(-rc);
+  }
+
+  void SendSuccessResponse(SessionId sessionId, const std::string &message)
+  {
+    LOG("session ", sessionId, ": ", message);
+  }
+
+  // Cancel the work of an active session, and keep it around until its operations are done
+  void DiscardSession(SessionId sessionId)
   {
-    if (m_CurrentSession->HasPendingOperations()) {
-      m_DiscardedSessions.push_back(std::move(m_CurrentSession));
+    auto it = m_Sessions.find(sessionId);
+    std::unique_ptr<Session> session = std::move(it->second);
+    m_Sessions.erase(it);
+#if __cpp_impl_coroutine
+    m_PipelineCancels.erase(sessionId); // Its operations get cancelled with the session
+#endif
+    if (session->HasPendingOperations()) {
+      session->Cancel();
+      m_DiscardedSessions.push_back({std::move(session), std::chrono::steady_clock::now()});
     }
     else {
-      m_CurrentSession.reset();
+      const size_t bytes = session->MemoryFootprint();
+      m_Reclaimer.Retire(std::move(session), bytes);
     }
-	
   }
+
+  // Time it took a discarded session to wind down its operations
+  void RecordQuiesceTime(std::chrono::steady_clock::duration elapsed)
+  {
+    const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed);
+    LOG_DEBUG("Session quiesced in ", ms.count(), " ms");
+    ++m_QuiescedCount;
+    m_LastQuiesceTime = ms;
+    m_TotalQuiesceTime += ms;
+    m_MaxQuiesceTime = std::max(m_MaxQuiesceTime, ms);
+  }
+
+  struct DiscardedSession
+  {
+    std::unique_ptr<Session> session;
+    std::chrono::steady_clock::time_point discardedAt;
+  };
+
+  // Begin or end request waiting for room in the graveyard
+  struct DeferredDiscard
+  {
+    SessionId sessionId;
+    bool restart; // Begin request
+    std::chrono::steady_clock::time_point deadline;
+  };
   
-  std::unique_ptr<Session> m_CurrentSession;
-  std::list<std::unique_ptr<Session>> m_DiscardedSessions;
+  const std::array<std::string, 3> m_SurfacePaths;
+  const GraveyardLimits m_GraveyardLimits;
+  const size_t m_QueueDepth;
+  ProcessorPool m_Processors; // Outlives the sessions, they give their processor back
+  CompletionQueue m_Completions; // Outlives the sessions
+  Reclaimer m_Reclaimer; // Destroys the sessions the main loop is done with
+  // Only touched from the main loop thread, like everything the requests and completions go through
+  std::map<SessionId, std::unique_ptr<Session>> m_Sessions;
+#if __cpp_impl_coroutine
+  std::map<SessionId, CancellationSource> m_PipelineCancels; // Of the last pipeline request of each session
+#endif
+  std::list<DiscardedSession> m_DiscardedSessions;
+  std::deque<DeferredDiscard> m_DeferredDiscards; // Oldest first
+  // Time-to-quiesce of the discarded sessions
+  uint64_t m_QuiescedCount = 0;
+  std::chrono::milliseconds m_LastQuiesceTime{0};
+  std::chrono::milliseconds m_TotalQuiesceTime{0};
+  std::chrono::milliseconds m_MaxQuiesceTime{0};
+  uint64_t m_DeferredDiscardCount = 0;
+  uint64_t m_RejectedDiscardCount = 0;
 };
 
 
 void print_usage()
 {
   std::cout << "Usage: Press a command letter, followed by <Enter>\n";
-  std::cout << " 'b' -> Begin a new session\n";
-  std::cout << " 'e' -> End current session\n";
+  std::cout << " '0'-'9' -> Select the session the next commands apply to, 0 at start\n";
+  std::cout << " 'b' -> Begin a new session, replacing the selected one\n";
+  std::cout << " 'e' -> End the selected session\n";
   std::cout << " 'l' -> Load surface\n";
   std::cout << " 'u' -> Update layers\n";
   std::cout << " 'g' -> Get preview points\n";
   std::cout << " 'c' -> Create design\n";
-  std::cout << " 'h' -> Print this help message\n";
+#if __cpp_impl_coroutine
+  std::cout << " 'p' -> Run the load, update layers and preview pipeline\n";
+#endif
+  std::cout << " 's' -> Print statistics\n";
+  std::cout << " 'h' -> Print this help message\n" << std::flush;
 }
 
-int main(int, char**)
+int main(int argc, char** argv)
 {
-  constexpr int timeout_ms = 100;
+  if (argc > 4) {
+    std::cerr << "Usage: " << argv[0] << " [critical.tin [cut.tin [fill.tin]]]\n";
+    return 1;
+  }
+  std::array<std::string, 3> surfacePaths;
+  for (int i = 1; i < argc; ++i) {
+    surfacePaths[i - 1] = argv[i];
+  }
 
-  pollfd pfd{};
-  pfd.fd = STDIN_FILENO;
-  pfd.events = POLLIN;
+  // Runtime log threshold, e.g. LOG_LEVEL=debug
+  if (const char *level = std::getenv("LOG_LEVEL")) {
+    for (auto candidate : {LogLevel::Trace, LogLevel::Debug, LogLevel::Info, LogLevel::Warning, LogLevel::Error, LogLevel::Off}) {
+      if (std::strcmp(level, to_string(candidate)) == 0) {
+	Logger::SetThreshold(candidate);
+      }
+    }
+  }
 
   print_usage();
 
-  MosaicComponent component;
+  MosaicComponent component(surfacePaths);
+
+  // We only wake up on user input, when an operation finished, or when a deferred request times out
+  pollfd pfds[2]{};
+  pfds[0].fd = STDIN_FILENO;
+  pfds[0].events = POLLIN;
+  pfds[1].fd = component.CompletionFd();
+  pfds[1].events = POLLIN;
+
+  MosaicComponent::SessionId selected = 0; // Session the commands apply to
   bool running = true;
   while (running) {
-    int rc = ::poll(&pfd, 1, timeout_ms);
+    int rc = ::poll(pfds, 2, component.PollTimeout());
     if (rc < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
       std::perror("poll");
       break;
     }
-    if (rc == 0) {
-      component.HandlePeriodicTasks();
+    component.HandleTimeouts();
+    if (pfds[1].revents & POLLIN) {
+      component.HandleCompletedOperations();
     }
-    else {
+    if (pfds[0].revents & (POLLIN | POLLHUP)) {
       char command;
       ssize_t n = ::read(STDIN_FILENO, &command, 1);
       if (n < 1) {
 	break; // Error or EOF
       }
       switch(command) {
+      case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
+	selected = static_cast<MosaicComponent::SessionId>(command - '0');
+	break;
       case 'b':
-	component.HandleBeginSessionRequest();
+	component.HandleBeginSessionRequest(selected);
 	break;
       case 'l':
-	component.HandleLoadSurfaceRequest();
+	component.HandleLoadSurfaceRequest(selected);
 	break;
       case 'u':
-	component.HandleUpdateLayersRequest();
+	component.HandleUpdateLayersRequest(selected);
 	break;
       case 'g':
-	component.HandleGetPreviewPointsRequest();
+	component.HandleGetPreviewPointsRequest(selected);
 	break;
       case 'c':
-	component.HandleCreateDesignRequest();
+	component.HandleCreateDesignRequest(selected);
 	break;
       case 'e':
-	component.HandleEndSessionRequest();
+	component.HandleEndSessionRequest(selected);
+	break;
+#if __cpp_impl_coroutine
+      case 'p':
+	component.HandlePipelineRequest(selected);
+	break;
+#endif
+      case 's':
+	component.HandleGetStatisticsRequest();
 	break;
       case 'h':
 	print_usage();
@@ -392,7 +5387,8 @@ int main(int, char**)
 	break;
       }
     }
-    pfd.revents = 0;    
+    pfds[0].revents = 0;
+    pfds[1].revents = 0;
   }
   return 0;
 }